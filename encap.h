@@ -0,0 +1,180 @@
+/*
+ This file defines the header that fakeserial and udp-broker prepend to the
+ IEEE 802.15.4 frames they exchange, once both sides agreed to use it.
+
+ Control datagrams: the HELLO and its answer, and the notifications of a
+ channel change ('C') and of a busy channel ('B'), are framed as IEEE
+ 802.15.4 frames that a peer predating them drops without a word, should a
+ broker that does not know them relay them as frames: ENCAP_CONTROL, the
+ type of the message, its payload, and an FCS (CRC-16 of the previous
+ bytes, little endian). ENCAP_CONTROL sets the reserved frame type 7, so
+ the kernel of such a peer rejects the frame once its FCS checked out.
+
+ Negotiation: on startup, fakeserial sends a HELLO control datagram
+ ('H', highest version it supports, number of devices as a 16 bits big
+ endian integer). A broker that supports the header answers with 'h' and
+ the version to use; from then on, every datagram exchanged with this
+ client starts with the header. A broker that does not understand HELLO
+ never answers, and both sides keep exchanging bare frames. Bare frames may
+ still cross the header during the negotiation: the first byte of the
+ header sets bit 7, which is reserved in the frame control field of an
+ IEEE 802.15.4 frame, so that both kinds of datagrams can be told apart.
+
+ Layout (24 bytes, multi-byte fields in network byte order):
+
+	 0  0xe0 | version
+	 1  type (ENCAP_FRAME, ENCAP_BUSY or ENCAP_TIME)
+	 2  channel
+	 3  LQI
+	 4  RSSI, in dBm (signed)
+	 5  flags: from the broker, ENCAP_EVERY_FRAME when the device is
+	    relayed every frame of the sender, 0 otherwise
+	 6  device: the device sending the frame (to the broker), or the device
+	    it is sent to (from the broker)
+	 8  link: from the broker, identifier of the sending device at the
+	    broker, 0 otherwise
+	12  sequence number, per sending device: as unicast frames only reach
+	    their destination, the gaps seen by a receiver are losses only
+	    with ENCAP_EVERY_FRAME (udp-broker -m)
+	16  date at which the sender sent the frame, in nanoseconds since the
+	    epoch (CLOCK_REALTIME), 0 when unknown
+
+ An ENCAP_FRAME header is followed by the frame (FCS included), an
+ ENCAP_BUSY header by the airtime of the frame starting on the channel,
+ in microseconds (16 bits, big endian).
+
+ An ENCAP_TIME header comes alone, and drives the virtual clock (udp-broker
+ -V): the date field of a client carries the time left until its next
+ pending event, in nanoseconds (all ones when there is none), the one of
+ the broker how far the virtual clock is ahead of the monotonic clock.
+*/
+
+#ifndef __ENCAP_H
+#define __ENCAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define ENCAP_VERSION 1
+#define ENCAP_MAGIC 0xe0
+#define ENCAP_MAGIC_MASK 0xf0
+#define ENCAP_HEADER_LEN 24
+
+#define ENCAP_FRAME 0
+#define ENCAP_BUSY 1
+#define ENCAP_TIME 2
+
+#define ENCAP_EVERY_FRAME 0x01
+
+#define ENCAP_HELLO 'H'
+#define ENCAP_HELLO_REPLY 'h'
+
+#define ENCAP_CONTROL 0xc7 /* reserved frame type 7 and frame control bit 7 */
+#define ENCAP_CONTROL_OVERHEAD 4 /* marker, type and FCS */
+#define ENCAP_CONTROL_MAX_LEN (ENCAP_CONTROL_OVERHEAD + 3)
+
+struct encap_header {
+	uint8_t version;
+	uint8_t type;
+	uint8_t channel;
+	uint8_t lqi;
+	int8_t rssi;
+	uint8_t flags;
+	uint16_t device;
+	uint32_t link;
+	uint32_t seq;
+	uint64_t timestamp;
+};
+
+static inline void encap_put(uint8_t * p, uint64_t v, int len) {
+	while (len--) {
+		p[len] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static inline uint64_t encap_get(const uint8_t * p, int len) {
+	uint64_t v = 0;
+
+	while (len--)
+		v = v << 8 | *p++;
+
+	return v;
+}
+
+static inline void encap_write(uint8_t * p, const struct encap_header * h) {
+	memset(p, 0, ENCAP_HEADER_LEN);
+	p[0] = ENCAP_MAGIC | h->version;
+	p[1] = h->type;
+	p[2] = h->channel;
+	p[3] = h->lqi;
+	p[4] = (uint8_t) h->rssi;
+	p[5] = h->flags;
+	encap_put(&p[6], h->device, 2);
+	encap_put(&p[8], h->link, 4);
+	encap_put(&p[12], h->seq, 4);
+	encap_put(&p[16], h->timestamp, 8);
+}
+
+/* returns -1 if the datagram does not start with a header of a known
+ * version (e.g. if it is a bare frame) */
+static inline int encap_read(const uint8_t * p, size_t len, struct encap_header * h) {
+	uint8_t version = p[0] & ~ENCAP_MAGIC_MASK;
+
+	if (len < ENCAP_HEADER_LEN || (p[0] & ENCAP_MAGIC_MASK) != ENCAP_MAGIC ||
+		version == 0 || version > ENCAP_VERSION)
+		return -1;
+
+	h->version = version;
+	h->type = p[1];
+	h->channel = p[2];
+	h->lqi = p[3];
+	h->rssi = (int8_t) p[4];
+	h->flags = p[5];
+	h->device = encap_get(&p[6], 2);
+	h->link = encap_get(&p[8], 4);
+	h->seq = encap_get(&p[12], 4);
+	h->timestamp = encap_get(&p[16], 8);
+
+	return 0;
+}
+
+/* CRC-16 of the FCS of IEEE 802.15.4 (see thirdparty/crc.c), bit by bit as
+ * the control datagrams are short */
+static inline uint16_t encap_fcs(const uint8_t * p, size_t len) {
+	uint16_t crc = 0;
+	int i;
+
+	while (len--)
+		for (crc ^= *p++, i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+
+	return crc;
+}
+
+/* build a control datagram around len bytes of payload (at most 3), and
+ * return its length */
+static inline size_t encap_control_write(uint8_t * p, uint8_t type, const uint8_t * payload, size_t len) {
+	uint16_t fcs;
+
+	p[0] = ENCAP_CONTROL;
+	p[1] = type;
+	memcpy(&p[2], payload, len);
+	fcs = encap_fcs(p, len + 2);
+	p[len + 2] = fcs & 0xff;
+	p[len + 3] = fcs >> 8;
+
+	return len + ENCAP_CONTROL_OVERHEAD;
+}
+
+/* returns the length of the payload of a control datagram, which starts at
+ * p + 2 (its type is p[1]), or -1 if the datagram is not one */
+static inline int encap_control_read(const uint8_t * p, size_t len) {
+	if (len < ENCAP_CONTROL_OVERHEAD || len > ENCAP_CONTROL_MAX_LEN || p[0] != ENCAP_CONTROL ||
+		encap_fcs(p, len - 2) != (p[len - 2] | p[len - 1] << 8))
+		return -1;
+
+	return len - ENCAP_CONTROL_OVERHEAD;
+}
+
+#endif /* __ENCAP_H */
@@ -21,12 +21,16 @@
 * this software.
 */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdlib.h>
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -34,27 +38,20 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
-#include <termios.h>
+#include <signal.h>
 #include <time.h>
+#include <limits.h>
+#include <stddef.h>
 #include "thirdparty/crc.h"
+#include "libfakeserial.h"
+#include "encap.h"
+#include "shmring.h"
 
 #define timespec_isnull(ts) \
 	((ts)->tv_sec == 0 && (ts)->tv_nsec == 0)
 
-#define timespec_cmp(left, right, OP) \
-	(((left)->tv_sec == (right)->tv_sec) ? \
-	 ((left)->tv_nsec OP (right)->tv_nsec) :\
-	 ((left)->tv_sec OP (right)->tv_sec))
-
-#define timespec_sub(left, right) \
-	do { \
-		(left)->tv_sec -= (right)->tv_sec; \
-		if ( (left)->tv_nsec < (right)->tv_nsec ) { \
-			--(left)->tv_sec; \
-			(left)->tv_nsec += NSEC; \
-		} \
-		(left)->tv_nsec -= (right)->tv_nsec; \
-	} while (0)
+#define timespec_to_ns(ts) \
+	((uint64_t) (ts)->tv_sec * NSEC + (ts)->tv_nsec)
 
 #define MSEC 1000
 #define USEC 1000000
@@ -64,6 +61,8 @@
 
 #undef max
 #define max(x,y) ((x) > (y) ? (x) : (y))
+#undef min
+#define min(x,y) ((x) < (y) ? (x) : (y))
 
 #ifdef DEBUG
 #define PRINTF(...) printf(__VA_ARGS__)
@@ -71,36 +70,36 @@
 #define PRINTF(...)
 #endif
 
-/* Linux serial command constants */
-#define START_BYTE1 'z'
-#define START_BYTE2 'b'
+/* smallest frame (an acknowledgement), shorter datagrams are dropped */
+#define IEEE802154_MIN_FRAME_LEN 5
 
-#define   OPEN          0x01
-#define   CLOSE         0x02
-#define   SET_CHANNEL   0x04
-#define   ED            0x05
-#define   CCA           0x06
-#define   SET_STATE     0x07
-#define   TX_BLOCK      0x09
-#define   RX_BLOCK      0x0b
-#define   GET_ADDR      0x0d
-#define   SET_PANID     0x0f
-#define   SET_SHORTADDR 0x10
-#define   SET_LONGADDR  0x11
-
-#define RESP_MASK 0x80
-
-#define SUCCESS 0x00
-
-#define IEEE802154_LONG_ADDR_LEN 8
-#define IEEE802154_SHORT_ADDR_LEN 2
-#define IEEE802154_FCS_LEN 2
+/* control messages (see encap.h) from the broker: the channel is busy for
+ * the next (16 bits) microseconds */
+#define BUSY_NOTIFICATION 'B'
+/* to the broker: the following frames are sent on (and the sender listens
+ * to) the given channel */
+#define CHANNEL_NOTIFICATION 'C'
+/* -u unix:/path reaches a broker on the same host through a unix socket */
+#define UNIX_PREFIX "unix:"
 
 #define SINGLE_CONNECTION 1
 /* 127 (max frame size) + 5 (max command size) */
 #define BUFSIZE 132
+/* datagrams exchanged with the backend may start with a header (encap.h) */
+#define BACKEND_BUFSIZE (ENCAP_HEADER_LEN + BUFSIZE)
+/* maximum number of readiness notifications handled per epoll_wait() call */
+#define MAX_IO_EVENTS 16
+/* maximum number of datagrams received or sent per system call */
+#define IO_BATCH 32
 
 #define BAUDRATE 921600
+/* largest link identifier whose statistics are kept, as the identifiers come
+ * from the network */
+#define MAX_LINKS 65535
+/* number of received frames that can wait for the kernel, per device */
+#define RX_QUEUE_DEFAULT 64
+/* longest frame written to the serial port (RX_BLOCK response) */
+#define RX_FRAME_MAX (3 + 1 + 1 + IEEE802154_MTU - IEEE802154_FCS_LEN)
 
 #define HAVE_GETOPT_LONG
 
@@ -117,22 +116,118 @@ static const struct option iz_long_opts[] = {
 	{ "delay-tx", required_argument, NULL, 'y' },
 	{ "latency", required_argument, NULL, 'l' },
 	{ "datarate", required_argument, NULL, 'd' },
+	{ "burst", required_argument, NULL, 'B' },
+	{ "devices", required_argument, NULL, 'N' },
+	{ "virtual-time", no_argument, NULL, 'V' },
+	{ "address-filter", no_argument, NULL, 'F' },
+	{ "auto-ack", no_argument, NULL, 'A' },
+	{ "tx-queue", required_argument, NULL, 'Q' },
+	{ "rx-queue", required_argument, NULL, 'R' },
+	{ "rx-drop", required_argument, NULL, 'P' },
 	{ NULL, 0, NULL, 0 },
 };
 #endif
 
 /* global variables */
 
-static uint16_t panid;
-static uint8_t ieee802154_long_addr[IEEE802154_LONG_ADDR_LEN];
-static uint8_t ieee802154_short_addr[IEEE802154_SHORT_ADDR_LEN];
-static int serialfd = 0;
 static char * devname = "fakeserial0";
+static int ndevices = 1;
 static int baudrate = BAUDRATE;
 static long datarate = 0;
+static long burst = IEEE802154_MTU;
 static struct timespec delay_tx;
 static struct timespec delay_rx;
 static struct timespec link_latency = { 0, 0 };
+static int virtual_time = 0;
+static int address_filter = 0;
+static int auto_ack = 0;
+static int tx_queue = 0;
+static unsigned int rx_queue_frames = RX_QUEUE_DEFAULT;
+static size_t rx_queue_bytes = 0;
+static int rx_drop = FAKESERIAL_DROP_TAIL;
+static unsigned int rx_drop_types = 0;
+
+/* a file descriptor registered with the event loop */
+struct io_source {
+	int fd;
+	void (*handler)(struct io_source * src, uint32_t events);
+	void * ctx;
+};
+
+/* frames received from a remote device, when the broker uses the header */
+struct link_stats {
+	uint64_t frames;
+	uint64_t lost; /* gaps in the sequence numbers */
+	uint64_t numbered; /* frames from a broker relaying every frame */
+	uint32_t next_seq;
+	uint64_t latency_sum; /* nanoseconds, over the frames with a date */
+	uint64_t latency_max;
+	uint64_t dated;
+};
+
+
+/* a fake serial port (see libfakeserial.h), and what the backend keeps
+ * about it */
+struct port {
+	struct fakeserial_device * dev;
+	struct io_source serial_src;
+	uint32_t tx_seq; /* sequence number of the next frame */
+	/* statistics of the frames received from each remote device,
+	 * indexed by its link identifier (see encap.h) */
+	struct link_stats * links;
+	uint32_t nlinks;
+	/* frames from a link identifier beyond MAX_LINKS, not accounted */
+	uint64_t unknown_links;
+};
+
+/* number of system calls and of datagrams they carried */
+struct batch_stats {
+	uint64_t calls;
+	uint64_t frames;
+	uint64_t largest; /* largest batch */
+};
+
+/* where the IEEE 802.15.4 frames are sent to
+ * datagrams are received with recvmmsg() and sent with sendmmsg(), so that
+ * bursts of frames only cost a few system calls */
+struct backend {
+	int sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	/* frames received during the last recvmmsg() call */
+	uint8_t rx_buf[IO_BATCH][BACKEND_BUFSIZE];
+	struct iovec rx_iov[IO_BATCH];
+	struct mmsghdr rx_msg[IO_BATCH];
+	/* frames waiting to be flushed by sendmmsg() */
+	uint8_t tx_buf[IO_BATCH][BACKEND_BUFSIZE];
+	struct iovec tx_iov[IO_BATCH];
+	struct mmsghdr tx_msg[IO_BATCH];
+	int tx_pending;
+	struct batch_stats rx_stats;
+	struct batch_stats tx_stats;
+	/* channel the broker relays frames on, for the whole socket, when the
+	 * header is not used */
+	uint8_t channel;
+	/* version of the header negotiated with the broker, 0 for bare frames */
+	uint8_t version;
+	/* rings shared with a broker on the same host (see shmring.h), NULL
+	 * when the frames go through the socket */
+	struct shm_area * shm;
+	int efd_in; /* signaled by the broker */
+	int efd_out; /* signaled by us */
+	uint64_t shm_drops;
+	/* with a virtual clock, next deadline the broker was told about */
+	uint64_t reported_deadline;
+};
+
+static int epollfd = -1;
+static struct io_source backend_src;
+static struct io_source timer_src;
+static struct backend backend;
+static struct fakeserial * fs;
+static struct port * ports;
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t exit_requested = 0;
 
 void print_version() {
 	printf("This software is provided \"AS IS.\"\n"
@@ -155,7 +250,9 @@ void print_usage(const char * prgname) {
 	printf("usage: %s -d destaddr -l portnum -r portnum [-b baudrate] [-n devicename]\n", prgname);
 	printf("-b, --baudrate: baudrate of the fake serial port (default \"%d\")\n"
 		   "-n, --device-name: name of the fake serial port (default \"/dev/fakeserial0\")\n"
-		   "-u, --udp-dest: destination address for the UDP traffic sent to the backend\n"
+		   "-u, --udp-dest: destination address for the UDP traffic sent to the backend,\n"
+		   "                unix:/path for the unix datagram socket of a broker on the same host,\n"
+		   "                or shm:/name to attach to a broker on the same host through shared memory\n"
 		   "-s, --udp-local-port: local udp port to be bound\n",
 		   BAUDRATE);
 	printf("-r, --udp-remote-port: remote UDP port to connect to and to bind locally\n"
@@ -163,86 +260,75 @@ void print_usage(const char * prgname) {
 		   "-y, --delay-tx: delay before transmission (from kernel to the UDP socket), in milliseconds\n"
 		   "-d, --datarate: data transmission/receiption rate, in bit per seconds (default unbounded)\n"
 		   "-l, --latency: latency of the underlaying link, in microseconds (default 0)\n"
+		   "-B, --burst: number of bytes that can be sent back to back when rate limiting (default %d)\n"
+		   "-N, --devices: number of fake serial ports served by this process (default 1)\n"
+		   "-V, --virtual-time: follow the virtual clock of the broker (see udp-broker -V)\n"
+		   "-F, --address-filter: drop the received frames for another PAN or address before they reach the kernel\n"
+		   "-A, --auto-ack: acknowledge the received frames that request it, instead of the kernel\n"
+		   "-Q, --tx-queue: number of frames the kernel may send ahead of the radio (default 0, at most %d)\n"
+		   "-R, --rx-queue: number of received frames waiting for the kernel, or of bytes with a b suffix (default %d)\n"
+		   "-P, --rx-drop: frames dropped when the RX queue is full: tail (the new frame, default), head (the oldest)\n"
+		   "               or a comma separated list of frame types to drop first (beacon, data, ack, command)\n"
 		   "-h, --help: this help message\n"
-		   "-v, --version: print program version and exits\n");
+		   "-v, --version: print program version and exits\n",
+		   IEEE802154_MTU, FAKESERIAL_TX_QUEUE_MAX, RX_QUEUE_DEFAULT);
 }
 
-/* can be used to compute both TX and RX delays */
-void compute_transmission_delay(const unsigned int packet_len, const unsigned long datarate, struct timespec * delay) {
-	uint64_t result;
-
-	result = ( (uint64_t) packet_len * 8 * NSEC ) / datarate;
-	delay->tv_sec = result / NSEC;
-	delay->tv_nsec = result % NSEC;
-	PRINTF("transmission delay is %ld seconds and %ld nanoseconds\n", delay->tv_sec, delay->tv_nsec);
-}
-
-/* return the file descriptor to the fake serial device */
-int set_serial(char * devname, int baudrate){
-	int fd;
-	struct termios tbuf;
-	char * ptmaster;
-
-	fd = open("/dev/ptmx", O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(EXIT_FAILURE);
-	}
-
-	if ( grantpt(fd) < 0 ) {
-		perror("grantpt");
+/* parse the depth of the RX queue: a number of frames, or of bytes when
+ * followed by "b" */
+void parse_rx_queue(const char * arg) {
+	char * end;
+	unsigned long depth = strtoul(arg, &end, 10);
+
+	if (end != arg && !strcmp(end, "b") && depth >= RX_FRAME_MAX) {
+		rx_queue_frames = 0;
+		rx_queue_bytes = depth;
+	} else if (end != arg && !*end && depth >= 1 && depth <= UINT_MAX) {
+		rx_queue_frames = depth;
+		rx_queue_bytes = 0;
+	} else {
+		fprintf(stderr, "the RX queue holds at least 1 frame or %d bytes\n", RX_FRAME_MAX);
 		exit(EXIT_FAILURE);
 	}
+}
 
-	if ( unlockpt(fd) < 0 ) {
-		perror("unlockpt");
-		exit(EXIT_FAILURE);
-	}
+/* parse the drop policy of the RX queue: tail, head or a list of frame
+ * types */
+void parse_rx_drop(char * arg) {
+	static const char * types[] = { "beacon", "data", "ack", "command" };
+	char * type;
+	unsigned int i;
 
-	/* create the serial port entry in /dev */
-	unlink(devname);
-	ptmaster = ptsname(fd);
-	if (!ptmaster) {
-		perror("ptsname");
-		exit(EXIT_FAILURE);
+	if (!strcmp(arg, "tail")) {
+		rx_drop = FAKESERIAL_DROP_TAIL;
+		return;
 	}
-
-	if ( symlink(ptmaster, devname) ) {
-		perror("symlink");
-		exit(EXIT_FAILURE);
+	if (!strcmp(arg, "head")) {
+		rx_drop = FAKESERIAL_DROP_HEAD;
+		return;
 	}
 
-	/* set, among other things, the baudrate of the pseudo-terminal */
-
-	memset(&tbuf, 0, sizeof(tbuf));
-
-	tbuf.c_iflag |= IGNBRK;
-	tbuf.c_cflag |= CLOCAL | CREAD | CS8;
-	tbuf.c_cc[VMIN] = 1;
-	tbuf.c_cc[VTIME] = 5;
-
-	switch (baudrate){
-	case 115200:
-		cfsetospeed(&tbuf, B115200);
-		cfsetispeed(&tbuf, B115200);
-		break;
-	case 921600:
-		cfsetospeed(&tbuf, B921600);
-		cfsetispeed(&tbuf, B921600);
-		break;
-	default:
-		fprintf(stderr, "speed %d is not supported\n", baudrate);
-	    exit(EXIT_FAILURE);
-	}
+	rx_drop = FAKESERIAL_DROP_TYPE;
+	rx_drop_types = 0;
+	for (type = strtok(arg, ","); type; type = strtok(NULL, ",")) {
+		for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+			if (!strcmp(type, types[i]))
+				break;
 
-	if ( tcsetattr(fd, TCSANOW, &tbuf) < 0 ) {
-		perror("tcsetattr");
-		exit(EXIT_FAILURE);
+		if (i == sizeof(types) / sizeof(types[0])) {
+			fprintf(stderr, "unknown RX drop policy or frame type: %s\n", type);
+			exit(EXIT_FAILURE);
+		}
+		rx_drop_types |= 1 << i;
 	}
-
-	return fd;
 }
 
+void signal_handler(int sig) {
+	if (sig == SIGUSR1)
+		stats_requested = 1;
+	else
+		exit_requested = 1;
+}
 
 int client_setup(struct sockaddr * dest_addr, socklen_t * addr_len,
 				 const char * dst, const char * lport,
@@ -279,7 +365,7 @@ int client_setup(struct sockaddr * dest_addr, socklen_t * addr_len,
 		   if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
 			   int ret = -1, yes = 1, sendbuff = 2048;
 			   struct sockaddr unspec;
-			   memcpy(dest_addr, rp->ai_addr, sizeof(struct sockaddr));
+			   memcpy(dest_addr, rp->ai_addr, rp->ai_addrlen);
 			   * addr_len = rp->ai_addrlen;
 
 			   memset(&unspec, 0, sizeof(struct sockaddr));
@@ -353,253 +439,675 @@ int client_setup(struct sockaddr * dest_addr, socklen_t * addr_len,
 	   return sfd;
 }
 
+/* open a unix datagram socket towards a broker running on the same host.
+ * The socket is bound to an abstract name picked by the kernel (autobind),
+ * so that the broker can answer and nothing is left in the file system */
+int unix_client_setup(struct sockaddr * dest_addr, socklen_t * addr_len, const char * path) {
+	struct sockaddr_un * sun = (struct sockaddr_un *) dest_addr;
+	sa_family_t family = AF_UNIX;
+	int sfd;
 
-/* read a single character and returns it
- * when this function is called, a character must be ready on the file
- * descriptor */
-uint8_t read_one_byte() {
-	uint8_t buf[1] = { 0 };
-	ssize_t bytes = 0;
-	fd_set readfds;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "unix socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	*addr_len = sizeof(*sun);
+
+	sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sfd < 0 || bind(sfd, (struct sockaddr *) &family, sizeof(family)) < 0) {
+		perror("unable to open the unix socket");
+		exit(EXIT_FAILURE);
+	}
 
-	FD_ZERO(&readfds);
-	FD_SET(serialfd, &readfds);
+	return sfd;
+}
 
-	if ( 0 >= select(serialfd+1, &readfds, NULL, NULL, NULL) ) {
-		perror("select()");
+/* attach to a broker running on the same host through shared memory (see
+ * shmring.h). The header is always used on this transport, so the HELLO is
+ * answered before the function returns.
+ * returns the connection to the broker, which must stay open */
+int shm_client_setup(struct backend * b, const char * name) {
+	struct sockaddr_un sun;
+	uint8_t msg[4] = { ENCAP_HELLO, ENCAP_VERSION, 0, 0 };
+	char control[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	struct iovec iov = { msg, sizeof(msg) };
+	struct msghdr mh;
+	struct cmsghdr * cmsg;
+	int fds[SHM_NFDS], conn;
+	socklen_t len;
+
+	fds[SHM_FD_AREA] = memfd_create("fakeserial", MFD_CLOEXEC);
+	if (fds[SHM_FD_AREA] < 0 || ftruncate(fds[SHM_FD_AREA], sizeof(struct shm_area)) < 0) {
+		perror("unable to create the shared memory");
 		exit(EXIT_FAILURE);
 	}
 
-	bytes = read(serialfd, buf, 1);
+	b->shm = mmap(NULL, sizeof(struct shm_area), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_AREA], 0);
+	if (b->shm == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
 
-	if ( bytes <= 0 ) {
-		if (errno == EIO) {
-			PRINTF("closed connection to the serial port\n");
-			close(serialfd);
-			while ( (serialfd = set_serial(devname, baudrate)) < 0 ){
-				PRINTF("unable to reopen serial port\n");
-			}
-		} else {
-			perror("read");
+	b->efd_out = fds[SHM_FD_TO_BROKER] = eventfd(0, EFD_CLOEXEC);
+	b->efd_in = fds[SHM_FD_TO_CLIENT] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (b->efd_out < 0 || b->efd_in < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the broker listens on an abstract socket */
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path + 1, sizeof(sun.sun_path) - 1, "%s%s", SHM_SOCKET_PREFIX, name);
+	len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun.sun_path + 1);
+
+	conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (conn < 0 || connect(conn, (struct sockaddr *) &sun, len) < 0) {
+		perror("unable to reach the broker through shared memory");
+		exit(EXIT_FAILURE);
+	}
+
+	msg[2] = ndevices >> 8;
+	msg[3] = ndevices & 0xff;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(control, 0, sizeof(control));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(SHM_NFDS * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, SHM_NFDS * sizeof(int));
+
+	if (sendmsg(conn, &mh, MSG_NOSIGNAL) < 0) {
+		perror("sendmsg()");
+		exit(EXIT_FAILURE);
+	}
+	/* the broker holds its own references now */
+	close(fds[SHM_FD_AREA]);
+
+	if (recv(conn, msg, sizeof(msg), 0) != 2 || msg[0] != ENCAP_HELLO_REPLY ||
+		!msg[1] || msg[1] > ENCAP_VERSION) {
+		fprintf(stderr, "the broker rejected the shared memory transport\n");
+		exit(EXIT_FAILURE);
+	}
+	b->version = msg[1];
+	PRINTF("attached to the broker through shared memory, header version %d\n", b->version);
+
+	return conn;
+}
+
+
+/* register a file descriptor with the event loop
+ * readiness is edge-triggered, so handlers must drain their file descriptor
+ * until EAGAIN */
+void reactor_add(struct io_source * src, uint32_t events) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLET;
+	ev.data.ptr = src;
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* date, in nanoseconds since the epoch, to compare with the date of remote
+ * processes */
+uint64_t realtime_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return timespec_to_ns(&ts);
+}
+
+/* set up the message headers used for batched I/O on the backend socket */
+void backend_init(struct backend * b) {
+	int i;
+
+	b->channel = IEEE802154_DEFAULT_CHANNEL;
+
+	for (i = 0; i < IO_BATCH; i++) {
+		b->rx_iov[i].iov_base = b->rx_buf[i];
+		b->rx_iov[i].iov_len = BACKEND_BUFSIZE;
+		b->rx_msg[i].msg_hdr.msg_iov = &b->rx_iov[i];
+		b->rx_msg[i].msg_hdr.msg_iovlen = 1;
+
+		b->tx_iov[i].iov_base = b->tx_buf[i];
+		b->tx_msg[i].msg_hdr.msg_iov = &b->tx_iov[i];
+		b->tx_msg[i].msg_hdr.msg_iovlen = 1;
+		b->tx_msg[i].msg_hdr.msg_name = &b->addr;
+		b->tx_msg[i].msg_hdr.msg_namelen = b->addrlen;
+	}
+}
+
+static void batch_account(struct batch_stats * st, int frames) {
+	++st->calls;
+	st->frames += frames;
+	st->largest = max(st->largest, (uint64_t) frames);
+}
+
+/* push the frames waiting in the TX batch to the shared memory ring.
+ * the broker is only woken up when it may have gone to sleep */
+void shm_flush(struct backend * b) {
+	uint64_t one = 1;
+	int i, ret, wake = 0;
+
+	for (i = 0; i < b->tx_pending; i++) {
+		ret = shm_ring_push(&b->shm->to_broker, NULL, 0, b->tx_buf[i], b->tx_iov[i].iov_len);
+		if (ret < 0)
+			++b->shm_drops;
+		wake |= ret > 0;
+	}
+
+	if (wake && write(b->efd_out, &one, sizeof(one)) < 0) {
+		perror("write()");
+		exit(EXIT_FAILURE);
+	}
+
+	batch_account(&b->tx_stats, b->tx_pending);
+	b->tx_pending = 0;
+}
+
+/* send all the frames waiting in the TX batch */
+void backend_flush(struct backend * b) {
+	int sent = 0, ret;
+
+	if (b->shm) {
+		if (b->tx_pending)
+			shm_flush(b);
+		return;
+	}
+
+	while (sent < b->tx_pending) {
+		ret = sendmmsg(b->sock, &b->tx_msg[sent], b->tx_pending - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("sendmmsg()");
 			exit(EXIT_FAILURE);
 		}
+
+		batch_account(&b->tx_stats, ret);
+		sent += ret;
 	}
 
-	/* PRINTF("%02X", buf[0]); */
+	b->tx_pending = 0;
+}
 
-	return buf[0];
+/* queue a datagram in the TX batch, after the header if there is one */
+void backend_queue(struct backend * b, const struct encap_header * h, const uint8_t * buf, uint8_t len) {
+	uint8_t * p;
+	size_t hlen = h ? ENCAP_HEADER_LEN : 0;
+
+	if (b->tx_pending == IO_BATCH)
+		backend_flush(b);
+
+	p = b->tx_buf[b->tx_pending];
+	if (h)
+		encap_write(p, h);
+	if (len)
+		memcpy(p + hlen, buf, len);
+	b->tx_iov[b->tx_pending].iov_len = hlen + len;
+	++b->tx_pending;
 }
 
-/* send a success message that matches the command */
-void send_success(uint8_t type) {
-	uint8_t buf[4] = { START_BYTE1,
-							 START_BYTE2,
-							 0, /* cmd */
-							 SUCCESS};
+/* tell the broker which channel the next frames are sent on */
+void backend_set_channel(struct backend * b, uint8_t channel) {
+	uint8_t msg[ENCAP_CONTROL_MAX_LEN];
 
-	buf[2] = type | RESP_MASK; /* compute the response type */
-	if ( write(serialfd, buf, 4) < 0 ) {
-		perror("write");
-		exit(EXIT_FAILURE);
+	if (b->channel == channel)
+		return;
+
+	backend_queue(b, NULL, msg, encap_control_write(msg, CHANNEL_NOTIFICATION, &channel, 1));
+	b->channel = channel;
+}
+
+/* tell the broker which channel a device listens to */
+void backend_set_device_channel(struct backend * b, const struct fakeserial_device * dev) {
+	uint8_t payload[3], msg[ENCAP_CONTROL_MAX_LEN];
+
+	payload[0] = fakeserial_device_channel(dev);
+	payload[1] = fakeserial_device_id(dev) >> 8;
+	payload[2] = fakeserial_device_id(dev) & 0xff;
+	backend_queue(b, NULL, msg, encap_control_write(msg, CHANNEL_NOTIFICATION, payload, sizeof(payload)));
+}
+
+/* offer the broker to exchange frames with a header (see encap.h) */
+void backend_hello(struct backend * b) {
+	uint8_t payload[3] = { ENCAP_VERSION, 0, 0 }, msg[ENCAP_CONTROL_MAX_LEN];
+
+	payload[1] = ndevices >> 8;
+	payload[2] = ndevices & 0xff;
+	backend_queue(b, NULL, msg, encap_control_write(msg, ENCAP_HELLO, payload, sizeof(payload)));
+}
+
+/* send a frame (FCS included) to the backend
+ * the frame is only queued, and is sent along with the other frames produced
+ * during the same event loop iteration
+ * a broker that does not use the header never sends a frame back to its
+ * sender, so the other devices of this process that listen to the same
+ * channel receive it directly */
+void send_to_backend(struct fakeserial_device * dev, const uint8_t * buf, uint8_t len) {
+	struct port * port = fakeserial_device_ctx(dev);
+	uint8_t channel = fakeserial_device_channel(dev);
+	struct encap_header h;
+	int i;
+	uint64_t now;
+
+	if (backend.version) {
+		memset(&h, 0, sizeof(h));
+		h.version = backend.version;
+		h.type = ENCAP_FRAME;
+		h.channel = channel;
+		h.device = fakeserial_device_id(dev);
+		h.seq = port->tx_seq++;
+		h.timestamp = realtime_ns();
+		backend_queue(&backend, &h, buf, len);
+	} else {
+		backend_set_channel(&backend, channel);
+		backend_queue(&backend, NULL, buf, len);
 	}
 
-	return;
+	/* with the header, the broker relays the frame to the other devices of
+	 * this process as well */
+	if (ndevices == 1 || backend.version)
+		return;
+
+	now = fakeserial_time(fs);
+	for (i = 0; i < ndevices; i++)
+		if (ports[i].dev != dev && fakeserial_device_channel(ports[i].dev) == channel)
+			fakeserial_inject_rx_frame(ports[i].dev, buf, len, 0xff, now);
+}
+
+/* the frames must leave before the kernel learns that the transmission
+ * ended, as it may send the next frame (or the remote side may answer it)
+ * right away */
+void tx_done(struct fakeserial_device * dev) {
+	(void) dev;
+	backend_flush(&backend);
+}
+
+/* without the header, the broker learns the new channel along with the next
+ * frame, or right away when the device does not share its socket */
+void set_channel(struct fakeserial_device * dev) {
+	if (backend.version)
+		backend_set_device_channel(&backend, dev);
+	else if (ndevices == 1)
+		backend_set_channel(&backend, fakeserial_device_channel(dev));
 }
 
-/* parse command from the linux serial driver
- * see http://sourceforge.net/apps/trac/linux-zigbee/wiki/SerialV1 */
-void parse_cmd(int tosock, struct sockaddr * dest_addr, socklen_t dest_addr_len) {
-	uint8_t buf[BUFSIZE] = { START_BYTE1, START_BYTE2 };
-	uint8_t cmd_type;
+/* tell the broker, that drives the virtual clock, when the next event is
+ * due (only when it changed) */
+void backend_report_deadline(struct backend * b) {
+	uint64_t deadline = fakeserial_next_deadline(fs), now;
+	struct encap_header h;
 
-	if ( START_BYTE1 != read_one_byte() )
+	if (deadline == b->reported_deadline)
 		return;
+	b->reported_deadline = deadline;
+
+	memset(&h, 0, sizeof(h));
+	h.version = b->version;
+	h.type = ENCAP_TIME;
+	h.timestamp = FAKESERIAL_NEVER;
+	if (deadline != FAKESERIAL_NEVER) {
+		now = fakeserial_time(fs);
+		h.timestamp = deadline - min(deadline, now);
+	}
+	backend_queue(b, &h, NULL, 0);
+}
 
-	PRINTF("received 'z'\n");
+/* handle a control message (see encap.h) of a given type and payload
+ * the broker tells when other radios transmit (see udp-broker -c) and
+ * answers the HELLO. The other messages come from the other clients of a
+ * broker that relays them as frames, and are ignored */
+void handle_control(struct backend * b, uint8_t type, const uint8_t * buf, int len) {
+	int i;
+
+	if (len == 2 && type == BUSY_NOTIFICATION) {
+		for (i = 0; i < ndevices; i++)
+			if (fakeserial_device_channel(ports[i].dev) == b->channel)
+				fakeserial_channel_busy(ports[i].dev, buf[0] << 8 | buf[1]);
+	} else if (len == 1 && type == ENCAP_HELLO_REPLY &&
+			   buf[0] && buf[0] <= ENCAP_VERSION && !b->version) {
+		PRINTF("the broker uses version %d of the header\n", buf[0]);
+		b->version = buf[0];
+		/* the channels the devices listen to are now per device */
+		for (i = 0; i < ndevices; i++)
+			if (fakeserial_device_channel(ports[i].dev) != IEEE802154_DEFAULT_CHANNEL)
+				backend_set_device_channel(b, ports[i].dev);
+	}
+}
 
-	if ( START_BYTE2 != read_one_byte() )
+/* account for a frame received from a remote device */
+void link_account(struct port * dev, const struct encap_header * h, uint64_t now) {
+	struct link_stats * l;
+	uint32_t n;
+
+	if (h->link > MAX_LINKS) {
+		++dev->unknown_links;
 		return;
+	}
 
-	PRINTF("received 'b'\n");
-
-	cmd_type = read_one_byte();
-
-	PRINTF("parse_cmd: received a command of type %d\n", cmd_type);
-
-	switch (cmd_type) {
-		case SET_PANID: {
-							uint8_t hi, lo;
-							hi = read_one_byte();
-							lo = read_one_byte();
-							panid = hi << 8 | lo;
-							send_success(cmd_type);
-							break;
-						}
-		case SET_SHORTADDR:
-						ieee802154_short_addr[1] = read_one_byte();
-						ieee802154_short_addr[0] = read_one_byte();
-						send_success(cmd_type);
-						break;
-		case SET_LONGADDR:
-						if ( read(serialfd, ieee802154_long_addr,
-									IEEE802154_LONG_ADDR_LEN) < 0) {
-							perror("read");
-							exit(EXIT_FAILURE);
-						}
-
-						send_success(cmd_type);
-						break;
-		case GET_ADDR: {
-						   int i = 0;
-						   buf[2] = cmd_type | RESP_MASK;
-						   buf[3] = SUCCESS;
-						   /* fill out the rest of the buffer */
-						   for(i=0; i< IEEE802154_LONG_ADDR_LEN; i++)
-							   buf[4+i] = ieee802154_long_addr[i];
-						   write(serialfd, buf, 2 + 1 + 1 + IEEE802154_LONG_ADDR_LEN);
-						   break;
-					   }
-		case TX_BLOCK: {
-						   uint8_t len = 0;
-						   uint16_t fcs;
-						   struct timespec transmission_delay = {0, 0};
-						   len =  read_one_byte();
-						   if ( read(serialfd, buf, len) != len ) {
-							   perror("read");
-							   exit(EXIT_FAILURE);
-						   }
-
-						   PRINTF("parse_cmd: sending IEEE 802.15.4 frame to the backend\n");
-
-							if (nanosleep(&delay_tx, NULL)) {
-								perror("nanosleep");
-								exit(EXIT_FAILURE);
-							}
-
-						   /* compute the FCS */
-						   fcs = crc16_block(0x0000, buf, len);
-						   buf[len] = fcs & 0xff;
-						   buf[len+1] = fcs >> 8;
-						   len += IEEE802154_FCS_LEN;
-
-						   if (sendto(tosock, buf, len, 0, dest_addr, dest_addr_len) < 0) {
-							   perror("sendto()");
-							   exit(EXIT_FAILURE);
-						   }
-
-						   /* mimics the behavior of a busy radio transceiver */
-						   compute_transmission_delay(len, datarate, &transmission_delay);
-						   if (timespec_cmp(&transmission_delay, &link_latency, <))
-						   {
-							   PRINTF("Link latency is too high for this data rate. "
-									   "It is VERY likely to prevent the rate limiting function from working correctly");
-						   } else if (datarate) {
-							   timespec_sub(&transmission_delay, &link_latency);
-
-							   PRINTF("transmission delay (when latency is removed) is %ld seconds and %ld nanoseconds\n",
-									  transmission_delay.tv_sec, transmission_delay.tv_nsec);
-							   if (nanosleep(&transmission_delay, NULL)) {
-								  perror("nanosleep");
-								  exit(EXIT_FAILURE);
-							   }
-						   }
-
-						   send_success(cmd_type);
-						   break;
-					   }
-		case SET_CHANNEL:
-					   /* currently ignore the channel being set */
-					   read_one_byte();
-					   send_success(cmd_type);
-					   break;
-		default:
-					   /* OPEN, CLOSE, ED, CCA, SET_STATE */
-					   send_success(cmd_type);
-	}
-
-	return;
-}
-
-void send_to_linux(int fromsock) {
-	uint8_t buf[BUFSIZE];
-	ssize_t msg_size;
-	uint16_t computed_fcs =0, msg_fcs = 0;
-	struct msghdr msg;
-	struct iovec iov;
-	struct timespec transmission_delay = {0,0};
-
-	/* Receive block command */
-	buf[0] = 'z';
-	buf[1] = 'b';
-	buf[2] = 0x8b;
-	/* LQI */
-	buf[3] = 0;
-
-	iov.iov_base = &buf[3 + 1 + 1];
-	iov.iov_len = BUFSIZE - (3 + 1 + 1);
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_iov = & iov;
-	msg.msg_iovlen = 1;
-	msg.msg_flags = 0;
-	msg.msg_control = NULL;
-	msg.msg_controllen = 0;
-
-	/* message length */
-	msg_size = recvmsg(fromsock, &msg, 0);
-	buf[4] = msg_size - IEEE802154_FCS_LEN;
-
-	if (msg_size <= 0) {
-		perror("recvmsg()");
-		exit(EXIT_FAILURE);
+	if (h->link >= dev->nlinks) {
+		n = min(max(h->link + 1, dev->nlinks * 2), MAX_LINKS + 1);
+		dev->links = realloc(dev->links, n * sizeof(*dev->links));
+		if (!dev->links) {
+			perror("realloc()");
+			exit(EXIT_FAILURE);
+		}
+		memset(&dev->links[dev->nlinks], 0, (n - dev->nlinks) * sizeof(*dev->links));
+		dev->nlinks = n;
 	}
 
-	if (nanosleep(&delay_rx, NULL)) {
-		perror("nanosleep");
-		exit(EXIT_FAILURE);
+	l = &dev->links[h->link];
+	/* sequence numbers going backwards are reordered frames, or a restart
+	 * of the remote device. Unless the broker relays every frame, the
+	 * unicast frames sent to other devices leave gaps as well */
+	if (h->flags & ENCAP_EVERY_FRAME) {
+		if (l->numbered && h->seq > l->next_seq)
+			l->lost += h->seq - l->next_seq;
+		l->numbered++;
+	}
+	l->next_seq = h->seq + 1;
+	l->frames++;
+
+	if (h->timestamp && now > h->timestamp) {
+		l->latency_sum += now - h->timestamp;
+		l->latency_max = max(l->latency_max, now - h->timestamp);
+		l->dated++;
 	}
+}
+
+/* check the length of a frame received from the backend */
+int frame_length_is_valid(ssize_t msg_size) {
+	if (msg_size < IEEE802154_FCS_LEN) {
+		printf("Received a message that is too short (%zd bytes), dropping it\n", msg_size);
+		return 0;
+	}
+
+	if (msg_size > IEEE802154_MTU) {
+		printf("Received a message that is too long (%zd bytes), dropping it\n", msg_size);
+		return 0;
+	}
+
+	return 1;
+}
 
-	msg_fcs = buf[3 + 1 + 1 + msg_size - 2] | buf[3 + 1 + 1 + msg_size - 1] << 8;
-	computed_fcs = crc16_block(0x0000, &buf[5], msg_size - IEEE802154_FCS_LEN);
+/* check the FCS of a frame against the CRC computed over its payload */
+int frame_fcs_is_valid(const uint8_t * buf, ssize_t msg_size, uint16_t computed_fcs) {
+	uint16_t msg_fcs = buf[msg_size - 2] | buf[msg_size - 1] << 8;
 
 	if ( msg_fcs != computed_fcs ) {
 		printf("Received a message with an incorrect CRC (received %X, expected %X), dropping it\n",
 			   msg_fcs, computed_fcs);
-	} else {
-		/* inject the packet in the Linux network stack */
-		write(serialfd, buf, 3 + 1 + 1 + msg_size - IEEE802154_FCS_LEN);
-	}
-
-	/* mimic the behavior of a busy radio while receiving */
-	compute_transmission_delay(msg_size, datarate, &transmission_delay);
-	if (timespec_cmp(&transmission_delay, &link_latency, <))
-	{
-		PRINTF("Link latency is too high for this data rate. "
-				"It is VERY likely to prevent the rate limiting function from working correctly\n");
-	} else if (datarate) {
-		timespec_sub(&transmission_delay, &link_latency);
-
-		PRINTF("transmission delay (when latency is removed) is %ld seconds and %ld nanoseconds\n",
-			   transmission_delay.tv_sec, transmission_delay.tv_nsec);
-		if (nanosleep(&transmission_delay, NULL)) {
-			perror("nanosleep");
-			exit(EXIT_FAILURE);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* read a batch of frames from the shared memory ring, the way recvmmsg()
+ * would. The eventfd is reset first, so that a frame pushed after the ring
+ * is seen empty signals it again */
+int shm_receive(struct backend * b) {
+	uint64_t count;
+	int n, len;
+
+	if (read(b->efd_in, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -1;
+
+	for (n = 0; n < IO_BATCH; n++) {
+		len = shm_ring_pop(&b->shm->to_client, b->rx_buf[n], BACKEND_BUFSIZE);
+		if (len < 0)
+			break;
+		b->rx_msg[n].msg_len = len;
+	}
+
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n;
+}
+
+/* receive a batch of frames from the backend and schedule their delivery to
+ * the kernel of every device
+ * returns 0 once the socket is drained */
+int receive_frames(struct backend * b) {
+	uint8_t * payload[IO_BATCH];
+	int payload_len[IO_BATCH];
+	struct encap_header h[IO_BATCH];
+	uint16_t fcs[IO_BATCH];
+	uint64_t now, sent, date;
+	int i, j, n, len, nvalid = 0;
+	struct fakeserial_device * dev;
+
+	if (b->shm)
+		n = shm_receive(b);
+	else
+		n = recvmmsg(b->sock, b->rx_msg, IO_BATCH, MSG_DONTWAIT, NULL);
+
+	if (n < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		if (errno == EINTR)
+			return 1;
+		perror("recvmmsg()");
+		exit(EXIT_FAILURE);
+	}
+
+	batch_account(&b->rx_stats, n);
+
+	/* checksum the whole batch at once */
+	for (i = 0; i < n; i++) {
+		payload[nvalid] = b->rx_buf[i];
+		len = b->rx_msg[i].msg_len;
+
+		if ( (j = encap_control_read(payload[nvalid], len)) >= 0 ) {
+			handle_control(b, payload[nvalid][1], payload[nvalid] + 2, j);
+			continue;
 		}
+		if (len < IEEE802154_MIN_FRAME_LEN)
+			continue;
+
+		h[nvalid].version = 0;
+		if (b->version && encap_read(payload[nvalid], len, &h[nvalid]) == 0) {
+			if (h[nvalid].device >= ndevices) {
+				printf("Received a message for an unknown device (%d), dropping it\n", h[nvalid].device);
+				continue;
+			}
+			payload[nvalid] += ENCAP_HEADER_LEN;
+			len -= ENCAP_HEADER_LEN;
+			if (h[nvalid].type == ENCAP_BUSY) {
+				if (len == 2)
+					fakeserial_channel_busy(ports[h[nvalid].device].dev,
+											payload[nvalid][0] << 8 | payload[nvalid][1]);
+				continue;
+			}
+			if (h[nvalid].type == ENCAP_TIME) {
+				/* the virtual clock jumped, release what became due */
+				if (virtual_time) {
+					fakeserial_set_clock_offset(fs, h[nvalid].timestamp);
+					fakeserial_run_timers(fs);
+				}
+				continue;
+			}
+		}
+
+		if (!frame_length_is_valid(len))
+			continue;
+		payload_len[nvalid] = len - IEEE802154_FCS_LEN;
+		fcs[nvalid] = 0x0000;
+		nvalid++;
 	}
+	crc16_block_multi(payload, payload_len, fcs, nvalid);
+
+	/* the frames were sent by the remote radio one link latency ago */
+	now = fakeserial_time(fs);
+	date = realtime_ns();
+	sent = now - min(now, timespec_to_ns(&link_latency));
+
+	for (i = 0; i < nvalid; i++) {
+		len = payload_len[i] + IEEE802154_FCS_LEN;
+		if (!frame_fcs_is_valid(payload[i], len, fcs[i]))
+			continue;
+
+		/* the broker tells which device the frame is for, or relays the
+		 * frames of the channel of the socket */
+		if (h[i].version) {
+			link_account(&ports[h[i].device], &h[i], date);
+			fakeserial_inject_rx_frame(ports[h[i].device].dev, payload[i], len, h[i].lqi, sent);
+			continue;
+		}
+		for (j = 0; j < ndevices; j++) {
+			dev = ports[j].dev;
+			if (fakeserial_device_channel(dev) == b->channel)
+				fakeserial_inject_rx_frame(dev, payload[i], len, 0, sent); /* no LQI */
+		}
+	}
+
+	/* a partial batch means that the socket is drained */
+	return n == IO_BATCH;
+}
+
+/* receive every frame waiting on the backend socket */
+void send_to_linux(struct backend * b) {
+	while (receive_frames(b))
+		;
+}
+
+/* print the statistics of a batched I/O direction */
+void batch_report(const char * name, const struct batch_stats * st) {
+	fprintf(stderr, "%s: %llu frames in %llu system calls (%.2f frames per call, largest batch: %llu)\n",
+			name, (unsigned long long) st->frames, (unsigned long long) st->calls,
+			st->calls ? (double) st->frames / st->calls : 0.0,
+			(unsigned long long) st->largest);
+}
 
-	return;
+/* print the statistics of the links towards a device */
+void links_report(const struct port * dev) {
+	const struct link_stats * l;
+	uint32_t i;
+
+	for (i = 0; i < dev->nlinks; i++) {
+		l = &dev->links[i];
+		if (!l->frames)
+			continue;
+		fprintf(stderr, "%s from link %u: %llu frames", fakeserial_device_name(dev->dev), i,
+				(unsigned long long) l->frames);
+		if (l->numbered)
+			fprintf(stderr, ", %llu lost (%.2f%%)", (unsigned long long) l->lost,
+					100.0 * l->lost / (l->numbered + l->lost));
+		else
+			fprintf(stderr, ", losses unknown (unicast frames filtered by the broker)");
+		if (l->dated)
+			fprintf(stderr, ", one-way latency %.1f us on average, %.1f us at most",
+					l->latency_sum / 1000.0 / l->dated, l->latency_max / 1000.0);
+		fprintf(stderr, "\n");
+	}
+	if (dev->unknown_links)
+		fprintf(stderr, "%s: %llu frames from a link identifier above %d not accounted\n",
+				fakeserial_device_name(dev->dev), (unsigned long long) dev->unknown_links, MAX_LINKS);
+}
+
+/* print the statistics of every device */
+void print_stats() {
+	int i;
+
+	batch_report("backend RX", &backend.rx_stats);
+	batch_report("backend TX", &backend.tx_stats);
+	if (backend.shm)
+		fprintf(stderr, "backend TX: %llu frames dropped on a full shared memory ring\n",
+				(unsigned long long) backend.shm_drops);
+
+	for (i = 0; i < ndevices; i++) {
+		fakeserial_device_report(ports[i].dev);
+		links_report(&ports[i]);
+	}
+}
+
+/* event loop handlers */
+
+void on_serial_event(struct io_source * src, uint32_t events) {
+	struct port * port = src->ctx;
+
+	/* the kernel read enough to write what waits for it */
+	if (events & EPOLLOUT)
+		fakeserial_device_output(port->dev);
+
+	if (!(events & ~EPOLLOUT))
+		return;
+
+	PRINTF("epoll: received a packet from the fake serial device\n");
+	/* need to parse the serial protocol. The kernel side of the port may
+	 * have been closed, and the port created again */
+	if (fakeserial_device_input(port->dev)) {
+		port->serial_src.fd = fakeserial_device_fd(port->dev);
+		reactor_add(&port->serial_src, EPOLLIN | EPOLLOUT);
+	}
+}
+
+void on_backend_event(struct io_source * src, uint32_t events) {
+	(void) src;
+	(void) events;
+	PRINTF("epoll: received a packet from backend\n");
+	/* pass the packet to the kernel */
+	send_to_linux(&backend);
+}
+
+void on_timer_event(struct io_source * src, uint32_t events) {
+	(void) src;
+	(void) events;
+	PRINTF("epoll: timer expired\n");
+	/* release the frames whose time has come */
+	fakeserial_run_timers(fs);
+}
+
+/* create the fake serial port of a device
+ * when several devices are created, their index replaces the number ending
+ * the device name (e.g. /dev/fakeserial0, /dev/fakeserial1, ...) */
+void port_init(struct port * port, int id) {
+	char name[PATH_MAX];
+	size_t len = strlen(devname);
+
+	if (ndevices == 1)
+		snprintf(name, sizeof(name), "%s", devname);
+	else {
+		while (len > 0 && devname[len - 1] >= '0' && devname[len - 1] <= '9')
+			--len;
+		snprintf(name, sizeof(name), "%.*s%d", (int) len, devname, id);
+	}
+
+	if ( !(port->dev = fakeserial_add_device(fs, name, port)) )
+		exit(EXIT_FAILURE);
+
+	port->serial_src.fd = fakeserial_device_fd(port->dev);
+	port->serial_src.handler = on_serial_event;
+	port->serial_src.ctx = port;
+	reactor_add(&port->serial_src, EPOLLIN | EPOLLOUT);
 }
 
 int main(int argc, char *argv[]) {
-	int udpsock;
-	int c, nfds;
-	fd_set readfds;
+	int c, i, nfds;
+	struct epoll_event events[MAX_IO_EVENTS];
 	char * clidest = NULL;
 	char * udp_dport = NULL;
 	char * udp_lport = NULL;
-	struct sockaddr dest_addr;
-	socklen_t dest_addr_len = 0;
+	struct sigaction sa;
+	struct fakeserial_config config;
+	struct fakeserial_ops ops = { send_to_backend, tx_done, set_channel };
+	int shm, local;
 
 	memset(&delay_rx, 0, sizeof(delay_rx));
 	memset(&delay_tx, 0, sizeof(delay_tx));
@@ -608,9 +1116,9 @@ int main(int argc, char *argv[]) {
 	while (1) {
 #ifdef HAVE_GETOPT_LONG
 		int opt_idx = -1;
-		c = getopt_long(argc, argv, "u:s:x:y:b:n:d:l:r:vh", iz_long_opts, &opt_idx);
+		c = getopt_long(argc, argv, "u:s:x:y:b:n:d:l:r:B:N:Q:R:P:VFAvh", iz_long_opts, &opt_idx);
 #else
-		c = getopt(argc, argv, "u:s:x:y:b:n:d:l:r:vh");
+		c = getopt(argc, argv, "u:s:x:y:b:n:d:l:r:B:N:Q:R:P:VFAvh");
 #endif
 		if (c == -1)
 			break;
@@ -624,6 +1132,7 @@ int main(int argc, char *argv[]) {
 				break;
 			case 'n':
 				devname = optarg;
+				break;
 			case 'r':
 				udp_dport = optarg;
 				break;
@@ -661,6 +1170,46 @@ int main(int argc, char *argv[]) {
 			case 'd':
 				datarate = atol(optarg);
 				break;
+			case 'N':
+				ndevices = atoi(optarg);
+
+				if (ndevices < 1) {
+					fprintf(stderr, "the number of devices must be at least 1\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'R':
+				parse_rx_queue(optarg);
+				break;
+			case 'P':
+				parse_rx_drop(optarg);
+				break;
+			case 'V':
+				virtual_time = 1;
+				break;
+			case 'F':
+				address_filter = 1;
+				break;
+			case 'A':
+				auto_ack = 1;
+				break;
+			case 'Q':
+				tx_queue = atoi(optarg);
+
+				if (tx_queue < 0 || tx_queue > FAKESERIAL_TX_QUEUE_MAX) {
+					fprintf(stderr, "the TX queue holds between 0 and %d frames\n",
+							FAKESERIAL_TX_QUEUE_MAX);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'B':
+				burst = atol(optarg);
+
+				if (burst < 0) {
+					fprintf(stderr, "burst must be a positive value\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'l': {
 				long latency_l = atol(optarg);
 
@@ -688,7 +1237,9 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
-	if ( !(udp_lport && clidest && udp_dport) ){
+	shm = clidest && !strncmp(clidest, SHM_PREFIX, strlen(SHM_PREFIX));
+	local = clidest && !strncmp(clidest, UNIX_PREFIX, strlen(UNIX_PREFIX));
+	if ( !(shm || local || (udp_lport && clidest && udp_dport)) ){
 		printf("-s, -r, and -u arguments must be set\n");
 		exit(EXIT_FAILURE);
 	}
@@ -702,44 +1253,117 @@ int main(int argc, char *argv[]) {
 			   "While it is not forbidden, it will result in a unpredictable delay.\n"
 			   "You have been warned!\n");
 
-	/* set the fake serial port */
-	serialfd = set_serial(devname, baudrate);
+	/* the serial protocol, the FCS and the pacing are handled by the
+	 * library, the frames go through the backend */
+	config.baudrate = baudrate;
+	config.datarate = datarate;
+	config.burst = burst;
+	config.delay_tx = timespec_to_ns(&delay_tx);
+	config.delay_rx = timespec_to_ns(&delay_rx);
+	config.address_filter = address_filter;
+	config.auto_ack = auto_ack;
+	config.tx_queue = tx_queue;
+	config.rx_queue_frames = rx_queue_frames;
+	config.rx_queue_bytes = rx_queue_bytes;
+	config.rx_drop = rx_drop;
+	config.rx_drop_types = rx_drop_types;
+	if ( !(fs = fakeserial_new(&config, &ops)) )
+		exit(EXIT_FAILURE);
 
-	/* open the client socket where the IEEE 802.15.4 MAC frames will be redirected */
-	udpsock = client_setup(&dest_addr, &dest_addr_len, clidest, udp_lport, udp_dport);
+	/* SIGUSR1 prints the statistics, SIGINT and SIGTERM terminate the
+	 * program cleanly */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-	if ( udpsock < 0 ) {
+	/* open the client socket where the IEEE 802.15.4 MAC frames will be redirected */
+	if (shm)
+		backend.sock = shm_client_setup(&backend, clidest + strlen(SHM_PREFIX));
+	else if (local)
+		backend.sock = unix_client_setup((struct sockaddr *) &backend.addr, &backend.addrlen,
+										 clidest + strlen(UNIX_PREFIX));
+	else
+		backend.sock = client_setup((struct sockaddr *) &backend.addr, &backend.addrlen,
+									clidest, udp_lport, udp_dport);
+
+	if ( backend.sock < 0 ) {
 		perror("client_setup()");
 		exit(EXIT_FAILURE);
 	}
 
+	backend_init(&backend);
+	backend.reported_deadline = FAKESERIAL_NEVER;
+
+	/* every file descriptor is registered once with the event loop */
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+
+	/* set the fake serial ports */
+	ports = calloc(ndevices, sizeof(struct port));
+	if (!ports) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < ndevices; i++)
+		port_init(&ports[i], i);
+
+	backend_src.fd = shm ? backend.efd_in : backend.sock;
+	backend_src.handler = on_backend_event;
+	reactor_add(&backend_src, EPOLLIN);
+
+	timer_src.fd = fakeserial_timerfd(fs);
+	timer_src.handler = on_timer_event;
+	reactor_add(&timer_src, EPOLLIN);
+
+	/* bare frames are used until the broker answers (the shared memory
+	 * transport negotiated the header already) */
+	if (!shm) {
+		backend_hello(&backend);
+		backend_flush(&backend);
+	}
+
 	/* start the processing loop */
-	while (1) {
-		FD_ZERO(&readfds);
-		FD_SET(serialfd, &readfds);
-		FD_SET(udpsock, &readfds);
-		nfds = max(serialfd, udpsock);
-
-		PRINTF("select: waiting for new activity\n");
-		if ( 0 >= select(nfds + 1, &readfds, NULL, NULL, NULL)) {
-			perror("select()");
-			exit(EXIT_FAILURE);
+	while (!exit_requested) {
+		if (stats_requested) {
+			print_stats();
+			stats_requested = 0;
 		}
 
-		if (FD_ISSET(udpsock, &readfds)) {
-			PRINTF("select: received a packet from backend\n");
-			/* pass the packet to the kernel */
-			send_to_linux(udpsock);
+		PRINTF("epoll: waiting for new activity\n");
+		nfds = epoll_wait(epollfd, events, MAX_IO_EVENTS, -1);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
 		}
-		if (FD_ISSET(serialfd, &readfds)) {
-			PRINTF("select: received a packet from the fake serial device\n");
-			/* need to parse the serial protocol */
-			parse_cmd(udpsock, &dest_addr, dest_addr_len);
+
+		for (i = 0; i < nfds; i++) {
+			struct io_source * src = events[i].data.ptr;
+
+			src->handler(src, events[i].events);
 		}
+
+		/* the broker only moves the virtual clock forward once it knows
+		 * what every client is waiting for */
+		if (virtual_time && backend.version)
+			backend_report_deadline(&backend);
+
+		/* send the frames produced during this iteration */
+		backend_flush(&backend);
 	}
 
-	unlink(devname);
-	close(udpsock);
-	close(serialfd);
+	print_stats();
+
+	fakeserial_free(fs);
+	close(backend.sock);
+	close(epollfd);
 	return 0;
 }
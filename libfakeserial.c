@@ -0,0 +1,1447 @@
+/* Tony Cheneau <tony.cheneau@nist.gov> */
+
+/*
+* Conditions Of Use
+*
+* This software was developed by employees of the National Institute of
+* Standards and Technology (NIST), and others.
+* This software has been contributed to the public domain.
+* Pursuant to title 15 Untied States Code Section 105, works of NIST
+* employees are not subject to copyright protection in the United States
+* and are considered to be in the public domain.
+* As a result, a formal license is not needed to use this software.
+*
+* This software is provided "AS IS."
+* NIST MAKES NO WARRANTY OF ANY KIND, EXPRESS, IMPLIED
+* OR STATUTORY, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT
+* AND DATA ACCURACY.  NIST does not warrant or make any representations
+* regarding the use of the software or the results thereof, including but
+* not limited to the correctness, accuracy, reliability or usefulness of
+* this software.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <limits.h>
+#include "thirdparty/crc.h"
+#include "libfakeserial.h"
+#include "mac802154.h"
+
+#define NSEC 1000000000
+#define USEC_TO_NSEC 1000
+
+#undef max
+#define max(x,y) ((x) > (y) ? (x) : (y))
+#undef min
+#define min(x,y) ((x) < (y) ? (x) : (y))
+
+#ifdef DEBUG
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+#define START_BYTE1 'z'
+#define START_BYTE2 'b'
+
+#define   OPEN          0x01
+#define   CLOSE         0x02
+#define   SET_CHANNEL   0x04
+#define   ED            0x05
+#define   CCA           0x06
+#define   SET_STATE     0x07
+#define   TX_BLOCK      0x09
+#define   RX_BLOCK      0x0b
+#define   GET_ADDR      0x0d
+#define   SET_PANID     0x0f
+#define   SET_SHORTADDR 0x10
+#define   SET_LONGADDR  0x11
+
+#define RESP_MASK 0x80
+
+#define SUCCESS 0x00
+#define BUSY 0x05
+#define ERR 0x08
+
+#define IEEE802154_LONG_ADDR_LEN 8
+#define IEEE802154_SHORT_ADDR_LEN 2
+
+#define BUFSIZE 132
+/* size of the ring buffer holding the bytes read from a serial port (must be
+ * a power of two) */
+#define RINGSIZE 4096
+/* number of frames that can be waiting in the TX and RX timelines, per device */
+#define MAX_EVENTS 256
+/* an acknowledgement is sent 12 symbols after the end of the frame */
+#define ACK_TURNAROUND 192000 /* nanoseconds */
+#define ACK_LEN (3 + IEEE802154_FCS_LEN)
+/* the kernel sends its own acknowledgement of a frame right after reading it:
+ * a later acknowledgement of the same sequence number is for another frame */
+#define ACK_SUPPRESS_WINDOW 100000000 /* nanoseconds */
+
+/* raw bytes read from the serial port, waiting to be parsed */
+struct ring {
+	uint8_t buf[RINGSIZE];
+	size_t head; /* index of the next byte to be parsed */
+	size_t tail; /* index of the next byte to be written */
+};
+
+/* state of the serial protocol parser */
+enum parser_state {
+	WAIT_START1,
+	WAIT_START2,
+	WAIT_CMD,
+	WAIT_LEN,
+	WAIT_DATA,
+};
+
+/* a command being assembled by the parser
+ * parsing can be resumed at any byte boundary, so that commands can be split
+ * across several read() calls */
+struct cmd_parser {
+	enum parser_state state;
+	uint8_t cmd;
+	uint8_t len; /* number of bytes of data expected for this command */
+	uint8_t received; /* number of bytes of data already received */
+	uint8_t data[BUFSIZE];
+};
+
+/* paces the frames of one direction according to the data rate
+ * this is a token bucket, expressed as a generic cell rate algorithm: every
+ * frame is scheduled against an absolute theoretical arrival time, so that
+ * rounding errors and scheduling jitter never accumulate */
+struct pacer {
+	uint64_t rate; /* data rate, in bit per seconds (0 when unbounded) */
+	uint64_t tolerance; /* burst size, expressed in nanoseconds */
+	uint64_t tat; /* theoretical arrival time of the next frame */
+	uint64_t remainder; /* fraction of nanosecond left over by the last frame */
+	/* statistics */
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t first_start;
+	uint64_t last_end;
+};
+
+/* kind of action attached to a point of the TX or RX timeline */
+enum event_type {
+	EV_TX_SEND, /* hand a frame to the program */
+	EV_TX_DONE, /* report the end of a transmission to the kernel */
+	EV_RX_DELIVER, /* write a received frame to the serial port */
+	EV_RX_DELIVER_ACKED, /* same, for a frame the radio acknowledged, which
+							the RX queue accepted when it was received */
+};
+
+struct event {
+	uint64_t deadline; /* date on the clock of the library, in nanoseconds */
+	uint64_t seq; /* keeps events with the same deadline in FIFO order */
+	enum event_type type;
+	struct fakeserial_device * dev;
+	uint8_t len;
+	uint8_t buf[BUFSIZE];
+};
+
+/* an entry of the RX queue, whose type is the MAC frame type of a received
+ * frame, or RX_RESPONSE for the response to a command */
+#define RX_RESPONSE 0xff
+/* initial number of entries of the RX queue, which doubles when needed */
+#define RX_QUEUE_SLOTS 16
+
+struct rx_entry {
+	uint8_t type;
+	uint8_t acked; /* the radio acknowledged the frame */
+	uint8_t len;
+	uint8_t buf[BUFSIZE];
+};
+
+/* what is waiting to be written to the serial port, while the kernel reads
+ * it at its own pace. Only the received frames count toward the depth of
+ * the queue, as the responses to the commands are never dropped */
+struct rx_queue {
+	struct rx_entry * entries; /* circular, capacity being a power of two */
+	unsigned int capacity;
+	unsigned int first;
+	unsigned int count;
+	unsigned int offset; /* bytes of the first entry already written */
+	unsigned int frames;
+	size_t bytes; /* of the frames */
+	/* room kept for the acknowledged frames waiting for their delivery */
+	unsigned int reserved_frames;
+	size_t reserved_bytes;
+	/* statistics */
+	uint64_t queued;
+	uint64_t dropped_tail;
+	uint64_t dropped_head;
+	uint64_t dropped_type;
+	uint64_t full; /* times the serial port could not take more bytes */
+	unsigned int frames_max;
+	size_t bytes_max;
+};
+
+/* deadline queue shared by the TX and RX timelines of all the devices
+ * each direction of each device keeps track of when its (emulated) radio
+ * becomes idle (see struct pacer), so that a transmission in progress never
+ * delays a reception and conversely. The pool grows by MAX_EVENTS events
+ * with every device */
+struct scheduler {
+	struct event ** free_events;
+	int nfree;
+	struct event ** heap; /* min-heap, ordered by deadline */
+	int nheap;
+	int capacity;
+	uint64_t seq;
+	int timerfd;
+	/* how far the clock of the library is ahead of the monotonic clock (see
+	 * fakeserial_set_clock_offset()) */
+	uint64_t offset;
+};
+
+/* an emulated IEEE 802.15.4 serial device (e.g. RedBee Econotag) */
+struct fakeserial_device {
+	struct fakeserial * fs;
+	int id;
+	char name[PATH_MAX];
+	void * ctx;
+	int serialfd;
+	struct ring ring;
+	struct cmd_parser parser;
+	struct pacer tx_pacer;
+	struct pacer rx_pacer;
+	struct rx_queue rxq;
+	struct event * events; /* the share of the device in the pool */
+	uint16_t panid;
+	uint8_t channel;
+	/* end of the last transmission another radio made on the channel */
+	uint64_t busy_until;
+	uint8_t long_addr[IEEE802154_LONG_ADDR_LEN];
+	uint8_t short_addr[IEEE802154_SHORT_ADDR_LEN];
+	/* frames dropped by the address filter */
+	uint64_t filtered_pan;
+	uint64_t filtered_addr;
+	/* for each sequence number acknowledged by the emulated radio, until
+	 * when the acknowledgement the kernel sends for it is dropped (starting
+	 * once the kernel could read the frame) */
+	uint64_t acked_until[256];
+	uint64_t auto_acks;
+	uint64_t acks_suppressed;
+	/* ends of the transmissions of the last frames the kernel handed over
+	 * (see fakeserial_config.tx_queue) */
+	uint64_t tx_ends[FAKESERIAL_TX_QUEUE_MAX];
+	unsigned int tx_next;
+	/* how long the kernel waits for the end of its transmissions and, with
+	 * a TX queue, how many frames are in flight when it hands one over */
+	uint64_t tx_waits;
+	uint64_t tx_wait_sum;
+	uint64_t tx_wait_max;
+	uint64_t tx_depth_sum;
+	int tx_depth_max;
+};
+
+struct fakeserial {
+	struct fakeserial_config config;
+	struct fakeserial_ops ops;
+	struct scheduler sched;
+	struct fakeserial_device ** devices;
+	int ndevices;
+};
+
+/* current time on the monotonic clock, in nanoseconds */
+uint64_t fakeserial_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* current date on the clock of the library */
+static uint64_t clock_now(const struct scheduler * s) {
+	return fakeserial_now() + s->offset;
+}
+
+/* set up a pacer for a data rate (in bit per seconds) and a burst size (in
+ * bytes) */
+static void pacer_init(struct pacer * p, unsigned long rate, unsigned long burst_len) {
+	memset(p, 0, sizeof(*p));
+	p->rate = rate;
+	if (rate)
+		p->tolerance = ( (uint64_t) burst_len * 8 * NSEC ) / rate;
+}
+
+/* schedule a frame of packet_len bytes that is ready to be sent at date ready
+ * returns the date at which its transmission starts, and stores the date at
+ * which its transmission ends in end (both are the same when unbounded) */
+static uint64_t pacer_schedule(struct pacer * p, uint64_t ready, unsigned int packet_len,
+							   uint64_t * end) {
+	uint64_t start = ready, duration = 0;
+
+	if (p->rate) {
+		uint64_t bits = (uint64_t) packet_len * 8 * NSEC + p->remainder;
+
+		/* the frame conforms as soon as the bucket holds enough tokens */
+		if (p->tat > ready + p->tolerance)
+			start = p->tat - p->tolerance;
+
+		duration = bits / p->rate;
+		p->remainder = bits % p->rate;
+		p->tat = max(p->tat, start) + duration;
+
+		/* a sender that lags behind its schedule (e.g. because of the time
+		 * the kernel takes to send the next frame) catches up within the
+		 * burst size through the start of its next frames, but each frame
+		 * still takes its whole airtime */
+		*end = start + duration;
+	} else
+		*end = start;
+
+	PRINTF("frame of %u bytes scheduled in %lu ns for %lu ns\n", packet_len,
+		   (unsigned long) (start - ready), (unsigned long) duration);
+
+	if (!p->frames)
+		p->first_start = start;
+	p->last_end = max(p->last_end, start + duration);
+	++p->frames;
+	p->bytes += packet_len;
+
+	return start;
+}
+
+/* print the configured and the achieved data rate */
+static void pacer_report(const char * name, const struct pacer * p) {
+	double achieved = 0;
+
+	if (p->last_end > p->first_start)
+		achieved = (double) p->bytes * 8 * NSEC / (p->last_end - p->first_start);
+
+	fprintf(stderr, "%s: %llu frames, %llu bytes", name,
+			(unsigned long long) p->frames, (unsigned long long) p->bytes);
+	if (p->rate)
+		fprintf(stderr, ", achieved %.0f bps (configured %llu bps)\n",
+				achieved, (unsigned long long) p->rate);
+	else
+		fprintf(stderr, " (data rate unbounded)\n");
+}
+
+/* return the file descriptor to the fake serial device, or -1 */
+static int set_serial(const char * devname, int baudrate){
+	int fd;
+	struct termios tbuf;
+	char * ptmaster;
+
+	/* the serial port is drained with large non-blocking reads */
+	fd = open("/dev/ptmx", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if ( grantpt(fd) < 0 || unlockpt(fd) < 0 ) {
+		perror("unable to unlock the pseudo-terminal");
+		close(fd);
+		return -1;
+	}
+
+	/* create the serial port entry in /dev */
+	unlink(devname);
+	ptmaster = ptsname(fd);
+	if ( !ptmaster || symlink(ptmaster, devname) ) {
+		perror("unable to create the serial port");
+		close(fd);
+		return -1;
+	}
+
+	/* set, among other things, the baudrate of the pseudo-terminal */
+
+	memset(&tbuf, 0, sizeof(tbuf));
+
+	tbuf.c_iflag |= IGNBRK;
+	tbuf.c_cflag |= CLOCAL | CREAD | CS8;
+	tbuf.c_cc[VMIN] = 1;
+	tbuf.c_cc[VTIME] = 5;
+
+	switch (baudrate){
+	case 115200:
+		cfsetospeed(&tbuf, B115200);
+		cfsetispeed(&tbuf, B115200);
+		break;
+	case 921600:
+		cfsetospeed(&tbuf, B921600);
+		cfsetispeed(&tbuf, B921600);
+		break;
+	default:
+		fprintf(stderr, "speed %d is not supported\n", baudrate);
+		close(fd);
+		return -1;
+	}
+
+	if ( tcsetattr(fd, TCSANOW, &tbuf) < 0 ) {
+		perror("tcsetattr");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* the entry at position i of a queue (0 being the next one written) */
+static struct rx_entry * rx_queue_entry(const struct rx_queue * q, unsigned int i) {
+	return &q->entries[(q->first + i) & (q->capacity - 1)];
+}
+
+/* make room for one more entry. Running out of memory is fatal: the
+ * responses to the commands, and the frames the radio acknowledged, must
+ * not be lost */
+static void rx_queue_grow(struct rx_queue * q) {
+	unsigned int capacity = q->capacity ? q->capacity * 2 : RX_QUEUE_SLOTS;
+	struct rx_entry * entries;
+	unsigned int i;
+
+	if (q->count < q->capacity)
+		return;
+
+	if ( !(entries = malloc(capacity * sizeof(*entries))) ) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < q->count; i++)
+		entries[i] = *rx_queue_entry(q, i);
+
+	free(q->entries);
+	q->entries = entries;
+	q->capacity = capacity;
+	q->first = 0;
+}
+
+/* remove the entry at position i */
+static void rx_queue_remove(struct rx_queue * q, unsigned int i) {
+	struct rx_entry * e = rx_queue_entry(q, i);
+
+	if (e->type != RX_RESPONSE) {
+		--q->frames;
+		q->bytes -= e->len;
+	}
+
+	if (i == 0) {
+		q->first = (q->first + 1) & (q->capacity - 1);
+		q->offset = 0;
+	} else
+		for (; i + 1 < q->count; i++)
+			*rx_queue_entry(q, i) = *rx_queue_entry(q, i + 1);
+
+	--q->count;
+}
+
+static void rx_queue_clear(struct rx_queue * q) {
+	q->count = q->offset = q->frames = 0;
+	q->bytes = 0;
+}
+
+/* is there room in the queue of a device for a frame of len bytes */
+static int rx_queue_fits(const struct fakeserial_device * dev, size_t len) {
+	const struct rx_queue * q = &dev->rxq;
+
+	return (!dev->fs->config.rx_queue_frames ||
+			q->frames + q->reserved_frames < dev->fs->config.rx_queue_frames) &&
+		(!dev->fs->config.rx_queue_bytes ||
+		 q->bytes + q->reserved_bytes + len <= dev->fs->config.rx_queue_bytes);
+}
+
+/* drop frames, according to the drop policy, until a frame of len bytes
+ * fits in the queue.
+ * returns 0 when the frame can be queued, -1 when it is dropped instead */
+static int rx_queue_make_room(struct fakeserial_device * dev, size_t len) {
+	struct fakeserial_config * config = &dev->fs->config;
+	struct rx_queue * q = &dev->rxq;
+	unsigned int i;
+
+	/* the frame being written can not be withdrawn */
+	i = q->offset ? 1 : 0;
+	while (!rx_queue_fits(dev, len) && config->rx_drop != FAKESERIAL_DROP_TAIL) {
+		struct rx_entry * e;
+
+		for (; i < q->count; i++) {
+			e = rx_queue_entry(q, i);
+			/* an acknowledged frame is as good as delivered */
+			if ( e->type != RX_RESPONSE && !e->acked &&
+				 (config->rx_drop == FAKESERIAL_DROP_HEAD || config->rx_drop_types & 1 << e->type) )
+				break;
+		}
+		if (i == q->count)
+			break;
+
+		if (config->rx_drop == FAKESERIAL_DROP_HEAD)
+			++q->dropped_head;
+		else
+			++q->dropped_type;
+		rx_queue_remove(q, i);
+	}
+
+	if (!rx_queue_fits(dev, len)) {
+		++q->dropped_tail;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* write the queue of a device to its serial port, until the port is full */
+static void rx_queue_flush(struct fakeserial_device * dev) {
+	struct rx_queue * q = &dev->rxq;
+
+	while (q->count) {
+		struct rx_entry * e = rx_queue_entry(q, 0);
+		ssize_t bytes = write(dev->serialfd, e->buf + q->offset, e->len - q->offset);
+
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN) {
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+
+			/* the program calls fakeserial_device_output() once the
+			 * kernel read enough */
+			++q->full;
+			return;
+		}
+
+		q->offset += bytes;
+		if (q->offset == e->len) {
+			/* the kernel is about to acknowledge the frame too */
+			if (e->acked)
+				dev->acked_until[e->buf[3 + 1 + 1 + 2]] =
+					clock_now(&dev->fs->sched) + ACK_SUPPRESS_WINDOW;
+			rx_queue_remove(q, 0);
+		}
+	}
+}
+
+/* queue a buffer for the serial port, and write it right away when nothing
+ * is waiting before it */
+static void rx_queue_push(struct fakeserial_device * dev, uint8_t type, int acked,
+						  const uint8_t * buf, size_t len) {
+	struct rx_queue * q = &dev->rxq;
+	struct rx_entry * e;
+
+	rx_queue_grow(q);
+
+	e = rx_queue_entry(q, q->count++);
+	e->type = type;
+	e->acked = acked;
+	e->len = len;
+	memcpy(e->buf, buf, len);
+
+	if (type != RX_RESPONSE) {
+		++q->queued;
+		++q->frames;
+		q->bytes += len;
+		q->frames_max = max(q->frames_max, q->frames);
+		q->bytes_max = max(q->bytes_max, q->bytes);
+	}
+
+	if (q->count == 1)
+		rx_queue_flush(dev);
+}
+
+/* write the response to a command to the fake serial port */
+static void write_serial(struct fakeserial_device * dev, const uint8_t * buf, size_t len) {
+	rx_queue_push(dev, RX_RESPONSE, 0, buf, len);
+}
+
+/* write a received frame (RX_BLOCK response) to the fake serial port, unless
+ * the RX queue is full and the drop policy picks it. A frame the radio
+ * acknowledged was given room when it was received, and is never dropped */
+static void deliver_frame(struct fakeserial_device * dev, const uint8_t * buf, size_t len, int acked) {
+	uint8_t type = len > 5 ? buf[5] & 0x7 : MAC_FRAME_DATA;
+
+	if (acked) {
+		--dev->rxq.reserved_frames;
+		dev->rxq.reserved_bytes -= len;
+	} else if (rx_queue_make_room(dev, len) < 0) {
+		PRINTF("deliver_frame: RX queue of %s full, dropping the frame\n", dev->name);
+		return;
+	}
+
+	rx_queue_push(dev, type, acked, buf, len);
+}
+
+/* send a success message that matches the command */
+static void send_success(struct fakeserial_device * dev, uint8_t type) {
+	uint8_t buf[4] = { START_BYTE1,
+							 START_BYTE2,
+							 0, /* cmd */
+							 SUCCESS};
+
+	buf[2] = type | RESP_MASK; /* compute the response type */
+	write_serial(dev, buf, 4);
+
+	return;
+}
+
+/* is another radio transmitting on the channel of a device */
+static int channel_is_busy(const struct fakeserial_device * dev) {
+	return clock_now(&dev->fs->sched) < dev->busy_until;
+}
+
+/* set up the deadline queue and the timer that drives it */
+static int sched_init(struct scheduler * s) {
+	memset(s, 0, sizeof(*s));
+	s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->timerfd < 0) {
+		perror("timerfd_create()");
+		return -1;
+	}
+	return 0;
+}
+
+/* add nevents events to the pool. The events never move, as the heap
+ * points to them */
+static struct event * sched_grow(struct scheduler * s, int nevents) {
+	struct event * events = calloc(nevents, sizeof(struct event));
+	struct event ** free_events = realloc(s->free_events, (s->capacity + nevents) * sizeof(struct event *));
+	struct event ** heap;
+	int i;
+
+	if (free_events)
+		s->free_events = free_events;
+	heap = realloc(s->heap, (s->capacity + nevents) * sizeof(struct event *));
+	if (heap)
+		s->heap = heap;
+	if (!events || !free_events || !heap) {
+		perror("unable to grow the event pool");
+		free(events);
+		return NULL;
+	}
+
+	for (i = 0; i < nevents; i++)
+		s->free_events[s->nfree++] = &events[i];
+	s->capacity += nevents;
+
+	return events;
+}
+
+static int event_before(const struct event * a, const struct event * b) {
+	if (a->deadline == b->deadline)
+		return a->seq < b->seq;
+	return a->deadline < b->deadline;
+}
+
+/* arm the timer for the earliest deadline (or disarm it when the queue is
+ * empty) */
+static void sched_arm(struct scheduler * s) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (s->nheap) {
+		/* the timer runs on the monotonic clock */
+		uint64_t deadline = s->heap[0]->deadline - min(s->heap[0]->deadline, s->offset);
+
+		its.it_value.tv_sec = deadline / NSEC;
+		its.it_value.tv_nsec = deadline % NSEC;
+		/* a zero value would disarm the timer */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* get an event from the pool, or NULL when too many frames are pending */
+static struct event * sched_alloc(struct scheduler * s) {
+	if (!s->nfree)
+		return NULL;
+	return s->free_events[--s->nfree];
+}
+
+/* give back to the pool an event that was run, or never scheduled */
+static void sched_free(struct scheduler * s, struct event * ev) {
+	s->free_events[s->nfree++] = ev;
+}
+
+/* insert an event in the deadline queue */
+static void sched_add(struct scheduler * s, struct event * ev, struct fakeserial_device * dev,
+					  enum event_type type, uint64_t deadline) {
+	int i = s->nheap++;
+
+	ev->dev = dev;
+	ev->type = type;
+	ev->deadline = deadline;
+	ev->seq = s->seq++;
+
+	/* sift up */
+	while (i > 0 && event_before(ev, s->heap[(i - 1) / 2])) {
+		s->heap[i] = s->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->heap[i] = ev;
+
+	if (s->heap[0] == ev)
+		sched_arm(s);
+}
+
+/* remove the earliest event from the deadline queue */
+static struct event * sched_pop(struct scheduler * s) {
+	struct event * top = s->heap[0], * last = s->heap[--s->nheap];
+	int i = 0;
+
+	/* sift down */
+	while (2 * i + 1 < s->nheap) {
+		int child = 2 * i + 1;
+
+		if (child + 1 < s->nheap && event_before(s->heap[child + 1], s->heap[child]))
+			++child;
+		if (!event_before(s->heap[child], last))
+			break;
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	s->heap[i] = last;
+
+	return top;
+}
+
+/* hand a frame the kernel sent to the program */
+static void tx_send(struct fakeserial_device * dev, const uint8_t * buf, uint8_t len) {
+	dev->fs->ops.on_tx_frame(dev, buf, len);
+}
+
+/* report the end of a transmission to the kernel
+ * the frame must have left before, as the kernel may send the next frame (or
+ * the remote side may answer it) as soon as it receives this response */
+static void tx_done(struct fakeserial_device * dev) {
+	if (dev->fs->ops.on_tx_done)
+		dev->fs->ops.on_tx_done(dev);
+	send_success(dev, TX_BLOCK);
+}
+
+/* run every event whose deadline has passed */
+void fakeserial_run_timers(struct fakeserial * fs) {
+	struct scheduler * s = &fs->sched;
+	uint64_t expirations, now;
+
+	/* acknowledge the timer expiration */
+	if (read(s->timerfd, &expirations, sizeof(expirations)) < 0 &&
+		errno != EAGAIN) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+
+	now = clock_now(s);
+	while (s->nheap && s->heap[0]->deadline <= now) {
+		struct event * ev = sched_pop(s);
+
+		switch (ev->type) {
+			case EV_TX_SEND:
+				PRINTF("sched_run: sending IEEE 802.15.4 frame to the backend\n");
+				tx_send(ev->dev, ev->buf, ev->len);
+				break;
+			case EV_TX_DONE:
+				tx_done(ev->dev);
+				break;
+			case EV_RX_DELIVER:
+				PRINTF("sched_run: delivering IEEE 802.15.4 frame to the kernel\n");
+				deliver_frame(ev->dev, ev->buf, ev->len, 0);
+				break;
+			case EV_RX_DELIVER_ACKED:
+				deliver_frame(ev->dev, ev->buf, ev->len, 1);
+				break;
+		}
+
+		sched_free(s, ev);
+	}
+
+	sched_arm(s);
+}
+
+/* number of bytes that are waiting to be parsed in the ring */
+static size_t ring_used(const struct ring * r) {
+	return r->tail - r->head;
+}
+
+/* read as much as possible from fd into the ring
+ * returns the number of bytes read, 0 when no data is available, or -1 when
+ * read() failed (errno is then set) */
+static ssize_t ring_fill(struct ring * r, int fd) {
+	ssize_t bytes, total = 0;
+
+	while (ring_used(r) < RINGSIZE) {
+		struct iovec iov[2];
+		size_t start = r->tail & (RINGSIZE - 1);
+		size_t free_bytes = RINGSIZE - ring_used(r);
+		int iovcnt = 1;
+
+		/* the free space may wrap around the end of the buffer */
+		iov[0].iov_base = &r->buf[start];
+		iov[0].iov_len = RINGSIZE - start;
+		if (iov[0].iov_len >= free_bytes)
+			iov[0].iov_len = free_bytes;
+		else {
+			iov[1].iov_base = r->buf;
+			iov[1].iov_len = free_bytes - iov[0].iov_len;
+			iovcnt = 2;
+		}
+
+		bytes = readv(fd, iov, iovcnt);
+
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		if (bytes == 0)
+			break;
+
+		r->tail += bytes;
+		total += bytes;
+	}
+
+	return total;
+}
+
+/* number of parameter bytes that follow a command
+ * (TX_BLOCK is handled separately, as its length is variable) */
+static uint8_t cmd_param_len(uint8_t cmd_type) {
+	switch (cmd_type) {
+		case SET_PANID:
+		case SET_SHORTADDR:
+			return 2;
+		case SET_LONGADDR:
+			return IEEE802154_LONG_ADDR_LEN;
+		case SET_CHANNEL:
+		case SET_STATE:
+			return 1;
+		default:
+			/* OPEN, CLOSE, ED, CCA, GET_ADDR */
+			return 0;
+	}
+}
+
+/* is a frame the kernel sends an acknowledgement the radio already sent.
+ * returns 1 when it is, and forgets about it */
+static int ack_already_sent(struct fakeserial_device * dev, const uint8_t * frame, uint8_t len) {
+	struct mac_header h;
+
+	if (mac_parse(frame, len, &h) < 0 || h.type != MAC_FRAME_ACK ||
+		dev->acked_until[h.seq] < clock_now(&dev->fs->sched))
+		return 0;
+
+	dev->acked_until[h.seq] = 0;
+	++dev->acks_suppressed;
+	return 1;
+}
+
+/* queue a frame that is transmitted until date end, when the kernel may
+ * hand over up to tx_queue frames in advance.
+ * returns when the kernel is told the frame is sent: right away, unless the
+ * queue is full, and then when the oldest frame leaves */
+static uint64_t tx_queue_push(struct fakeserial_device * dev, uint64_t now, uint64_t end) {
+	int i, depth = 0, size = dev->fs->config.tx_queue;
+	uint64_t * oldest = &dev->tx_ends[dev->tx_next++ % size];
+	uint64_t done = max(now, *oldest);
+
+	*oldest = end;
+	for (i = 0; i < size; i++)
+		if (dev->tx_ends[i] > now)
+			++depth;
+
+	dev->tx_depth_sum += depth;
+	dev->tx_depth_max = max(dev->tx_depth_max, depth);
+
+	return done;
+}
+
+/* execute a fully received command */
+static void handle_cmd(struct fakeserial_device * dev) {
+	uint8_t buf[BUFSIZE] = { START_BYTE1, START_BYTE2 };
+	struct cmd_parser * p = &dev->parser;
+	struct fakeserial * fs = dev->fs;
+	uint8_t cmd_type = p->cmd;
+
+	PRINTF("handle_cmd: %s received a command of type %d\n", dev->name, cmd_type);
+
+	switch (cmd_type) {
+		case SET_PANID:
+						dev->panid = p->data[0] << 8 | p->data[1];
+						send_success(dev, cmd_type);
+						break;
+		case SET_SHORTADDR:
+						dev->short_addr[1] = p->data[0];
+						dev->short_addr[0] = p->data[1];
+						send_success(dev, cmd_type);
+						break;
+		case SET_LONGADDR:
+						memcpy(dev->long_addr, p->data,
+							   IEEE802154_LONG_ADDR_LEN);
+						send_success(dev, cmd_type);
+						break;
+		case GET_ADDR: {
+						   int i = 0;
+						   buf[2] = cmd_type | RESP_MASK;
+						   buf[3] = SUCCESS;
+						   /* fill out the rest of the buffer */
+						   for(i=0; i< IEEE802154_LONG_ADDR_LEN; i++)
+							   buf[4+i] = dev->long_addr[i];
+						   write_serial(dev, buf, 2 + 1 + 1 + IEEE802154_LONG_ADDR_LEN);
+						   break;
+					   }
+		case TX_BLOCK: {
+						   uint8_t len = p->len;
+						   uint16_t fcs;
+						   uint64_t now, start, end, done;
+						   struct event * send_ev, * done_ev;
+
+						   memcpy(buf, p->data, len);
+
+						   /* the radio acknowledged the frame already */
+						   if (fs->config.auto_ack && ack_already_sent(dev, buf, len)) {
+							   send_success(dev, cmd_type);
+							   break;
+						   }
+
+						   /* compute the FCS */
+						   fcs = crc16_block(0x0000, buf, len);
+						   buf[len] = fcs & 0xff;
+						   buf[len+1] = fcs >> 8;
+						   len += IEEE802154_FCS_LEN;
+
+						   /* the frame leaves after the TX delay, once the
+							* data rate allows it, and the radio stays busy
+							* until the end of its transmission */
+						   now = clock_now(&fs->sched);
+						   start = pacer_schedule(&dev->tx_pacer,
+								   now + fs->config.delay_tx, len, &end);
+
+						   if (start <= now) {
+							   PRINTF("handle_cmd: sending IEEE 802.15.4 frame to the backend\n");
+							   tx_send(dev, buf, len);
+						   } else {
+							   send_ev = sched_alloc(&fs->sched);
+							   if (!send_ev) {
+								   fprintf(stderr, "too many pending frames, dropping the frame\n");
+								   send_success(dev, cmd_type);
+								   break;
+							   }
+							   memcpy(send_ev->buf, buf, len);
+							   send_ev->len = len;
+							   sched_add(&fs->sched, send_ev, dev, EV_TX_SEND, start);
+						   }
+
+						   done = end;
+						   if (fs->config.tx_queue)
+							   done = tx_queue_push(dev, now, end);
+
+						   ++dev->tx_waits;
+						   dev->tx_wait_sum += done - now;
+						   dev->tx_wait_max = max(dev->tx_wait_max, done - now);
+
+						   if (done <= now) {
+							   tx_done(dev);
+						   } else {
+							   done_ev = sched_alloc(&fs->sched);
+							   if (!done_ev) {
+								   /* do not leave the kernel waiting */
+								   tx_done(dev);
+								   break;
+							   }
+							   sched_add(&fs->sched, done_ev, dev, EV_TX_DONE, done);
+						   }
+						   break;
+					   }
+		case SET_CHANNEL:
+					   if (p->data[0] > IEEE802154_CHANNEL_MAX) {
+						   buf[2] = cmd_type | RESP_MASK;
+						   buf[3] = ERR;
+						   write_serial(dev, buf, 4);
+						   break;
+					   }
+					   dev->channel = p->data[0];
+					   if (fs->ops.on_set_channel)
+						   fs->ops.on_set_channel(dev);
+					   send_success(dev, cmd_type);
+					   break;
+		case CCA:
+					   buf[2] = cmd_type | RESP_MASK;
+					   buf[3] = channel_is_busy(dev) ? BUSY : SUCCESS;
+					   write_serial(dev, buf, 4);
+					   break;
+		case ED:
+					   /* the energy level is either the lowest or the highest */
+					   buf[2] = cmd_type | RESP_MASK;
+					   buf[3] = SUCCESS;
+					   buf[4] = channel_is_busy(dev) ? 0xff : 0x00;
+					   write_serial(dev, buf, 5);
+					   break;
+		default:
+					   /* OPEN, CLOSE, SET_STATE */
+					   send_success(dev, cmd_type);
+	}
+
+	return;
+}
+
+/* feed the bytes stored in the ring to the parser and execute every command
+ * that is complete
+ * see http://sourceforge.net/apps/trac/linux-zigbee/wiki/SerialV1 */
+static void parse_ring(struct fakeserial_device * dev) {
+	struct cmd_parser * p = &dev->parser;
+	struct ring * r = &dev->ring;
+
+	while (ring_used(r) > 0) {
+		uint8_t c;
+
+		if (p->state == WAIT_DATA) {
+			/* copy as much of the command data as possible at once */
+			size_t start = r->head & (RINGSIZE - 1);
+			size_t chunk = p->len - p->received;
+
+			if (chunk > ring_used(r))
+				chunk = ring_used(r);
+			if (chunk > RINGSIZE - start)
+				chunk = RINGSIZE - start;
+
+			memcpy(&p->data[p->received], &r->buf[start], chunk);
+			p->received += chunk;
+			r->head += chunk;
+
+			if (p->received == p->len) {
+				handle_cmd(dev);
+				p->state = WAIT_START1;
+			}
+			continue;
+		}
+
+		c = r->buf[r->head & (RINGSIZE - 1)];
+		++r->head;
+
+		switch (p->state) {
+			case WAIT_START1:
+				if (c == START_BYTE1) {
+					PRINTF("received 'z'\n");
+					p->state = WAIT_START2;
+				}
+				break;
+			case WAIT_START2:
+				if (c == START_BYTE2) {
+					PRINTF("received 'b'\n");
+					p->state = WAIT_CMD;
+				} else
+					p->state = (c == START_BYTE1) ? WAIT_START2 : WAIT_START1;
+				break;
+			case WAIT_CMD:
+				p->cmd = c;
+				p->received = 0;
+				if (c == TX_BLOCK) {
+					p->state = WAIT_LEN;
+					break;
+				}
+
+				p->len = cmd_param_len(c);
+				if (p->len) {
+					p->state = WAIT_DATA;
+				} else {
+					handle_cmd(dev);
+					p->state = WAIT_START1;
+				}
+				break;
+			case WAIT_LEN:
+				/* leave room for the FCS that is appended before sending */
+				if (c > BUFSIZE - IEEE802154_FCS_LEN) {
+					fprintf(stderr, "invalid TX_BLOCK length (%d), dropping the command\n", c);
+					p->state = WAIT_START1;
+					break;
+				}
+
+				p->len = c;
+				if (p->len) {
+					p->state = WAIT_DATA;
+				} else {
+					handle_cmd(dev);
+					p->state = WAIT_START1;
+				}
+				break;
+			case WAIT_DATA:
+				/* handled above */
+				break;
+		}
+	}
+}
+
+/* drain the serial port and process every command that was received
+ * several commands may be processed in a single call, and a command that is
+ * only partially received is completed during a subsequent call */
+int fakeserial_device_input(struct fakeserial_device * dev) {
+	while (1) {
+		ssize_t bytes = ring_fill(&dev->ring, dev->serialfd);
+
+		if (bytes < 0) {
+			if (errno == EIO) {
+				PRINTF("closed connection to the serial port %s\n", dev->name);
+				close(dev->serialfd);
+				while ( (dev->serialfd = set_serial(dev->name, dev->fs->config.baudrate)) < 0 ){
+					PRINTF("unable to reopen serial port\n");
+				}
+				/* drop any partially received command, and what the
+				 * former kernel side did not read */
+				dev->ring.head = dev->ring.tail = 0;
+				dev->parser.state = WAIT_START1;
+				rx_queue_clear(&dev->rxq);
+				return 1;
+			} else {
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		parse_ring(dev);
+
+		/* the ring was not filled up, so the serial port is drained */
+		if (bytes < RINGSIZE)
+			break;
+	}
+
+	return 0;
+}
+
+void fakeserial_device_output(struct fakeserial_device * dev) {
+	rx_queue_flush(dev);
+}
+
+size_t fakeserial_device_output_pending(const struct fakeserial_device * dev) {
+	const struct rx_queue * q = &dev->rxq;
+	size_t bytes = 0;
+	unsigned int i;
+
+	for (i = 0; i < q->count; i++)
+		bytes += rx_queue_entry(q, i)->len;
+
+	return bytes - q->offset;
+}
+
+/* the extended address the kernel set, which it sends most significant
+ * byte first */
+static uint64_t device_long_addr(const struct fakeserial_device * dev) {
+	uint64_t addr = 0;
+	int i;
+
+	for (i = 0; i < IEEE802154_LONG_ADDR_LEN; i++)
+		addr = addr << 8 | dev->long_addr[i];
+
+	return addr;
+}
+
+static uint16_t device_short_addr(const struct fakeserial_device * dev) {
+	return dev->short_addr[0] | dev->short_addr[1] << 8;
+}
+
+/* is a frame sent to the device itself (and not broadcast) */
+static int mac_is_for_device(const struct fakeserial_device * dev, const struct mac_header * h) {
+	if (h->dst_pan != MAC_BROADCAST && h->dst_pan != dev->panid)
+		return 0;
+
+	return (h->dst_mode == MAC_ADDR_SHORT && h->dst == device_short_addr(dev)) ||
+		(h->dst_mode == MAC_ADDR_LONG && h->dst == device_long_addr(dev));
+}
+
+/* address recognition, as a transceiver does it (IEEE 802.15.4-2006,
+ * 7.5.6.2): is a frame for the PAN and the addresses the kernel set.
+ * returns 1 when the frame is accepted, and accounts for the others */
+static int address_filter(struct fakeserial_device * dev, const struct mac_header * h) {
+	if (h->type == MAC_FRAME_ACK)
+		return 1;
+
+	if (h->type == MAC_FRAME_BEACON) {
+		if (dev->panid != MAC_BROADCAST && h->src_pan != dev->panid) {
+			++dev->filtered_pan;
+			return 0;
+		}
+		return 1;
+	}
+
+	/* without a destination, only the frames of the PAN are accepted */
+	if (!h->dst_mode) {
+		if (h->src_pan != dev->panid) {
+			++dev->filtered_pan;
+			return 0;
+		}
+		return 1;
+	}
+
+	if (h->dst_pan != MAC_BROADCAST && h->dst_pan != dev->panid) {
+		++dev->filtered_pan;
+		return 0;
+	}
+
+	if (!mac_is_unicast(h) || mac_is_for_device(dev, h))
+		return 1;
+
+	++dev->filtered_addr;
+	return 0;
+}
+
+/* acknowledge a frame that requests it, as the radio does it by itself,
+ * one turnaround time after the end of its reception (end) */
+static void auto_ack(struct fakeserial_device * dev, const struct mac_header * h, uint64_t end) {
+	struct fakeserial * fs = dev->fs;
+	uint8_t ack[ACK_LEN] = { MAC_FRAME_ACK, 0, h->seq };
+	uint16_t fcs = crc16_block(0x0000, ack, ACK_LEN - IEEE802154_FCS_LEN);
+	struct event * ev;
+
+	ack[3] = fcs & 0xff;
+	ack[4] = fcs >> 8;
+	++dev->auto_acks;
+
+	if (!(ev = sched_alloc(&fs->sched))) {
+		tx_send(dev, ack, ACK_LEN);
+		return;
+	}
+	memcpy(ev->buf, ack, ACK_LEN);
+	ev->len = ACK_LEN;
+	sched_add(&fs->sched, ev, dev, EV_TX_SEND, end + ACK_TURNAROUND);
+}
+
+/* schedule the delivery of a frame (FCS included) to the kernel of a device
+ * sent is the date at which the remote radio started transmitting it */
+void fakeserial_inject_rx_frame(struct fakeserial_device * dev, const uint8_t * frame, uint8_t len,
+								uint8_t lqi, uint64_t sent) {
+	struct fakeserial * fs = dev->fs;
+	uint8_t buf[BUFSIZE];
+	struct mac_header h;
+	struct event * ev = NULL;
+	uint64_t end, deliver, now = clock_now(&fs->sched);
+	int acked = 0;
+
+	/* Receive block command */
+	buf[0] = 'z';
+	buf[1] = 'b';
+	buf[2] = 0x8b;
+	/* LQI */
+	buf[3] = lqi;
+	/* message length */
+	buf[4] = len - IEEE802154_FCS_LEN;
+	memcpy(&buf[3 + 1 + 1], frame, len - IEEE802154_FCS_LEN);
+
+	/* the frame is only delivered once it is fully received (and after the
+	 * RX delay) */
+	pacer_schedule(&dev->rx_pacer, min(sent, now), len, &end);
+	deliver = max(now + fs->config.delay_rx, end);
+
+	if ( (fs->config.address_filter || fs->config.auto_ack) &&
+		 mac_parse(frame, len, &h) == 0 ) {
+		/* a frame for another device still kept the radio busy, but never
+		 * reaches the kernel */
+		if (fs->config.address_filter && !address_filter(dev, &h))
+			return;
+
+		acked = fs->config.auto_ack && (h.fcf & MAC_FCF_ACK_REQUEST) &&
+			(h.type == MAC_FRAME_DATA || h.type == MAC_FRAME_COMMAND) &&
+			mac_is_for_device(dev, &h);
+	}
+
+	if (deliver > now && !(ev = sched_alloc(&fs->sched))) {
+		fprintf(stderr, "too many pending frames, dropping the frame\n");
+		return;
+	}
+
+	/* the radio only acknowledges a frame the kernel is going to get: the RX
+	 * queue decides when the frame is received, rather than once the RX
+	 * delay passed, and keeps its room until it is delivered */
+	if (acked) {
+		if (rx_queue_make_room(dev, 3 + 1 + 1 + len - IEEE802154_FCS_LEN) < 0) {
+			if (ev)
+				sched_free(&fs->sched, ev);
+			return;
+		}
+		++dev->rxq.reserved_frames;
+		dev->rxq.reserved_bytes += 3 + 1 + 1 + len - IEEE802154_FCS_LEN;
+		auto_ack(dev, &h, max(end, now));
+	}
+
+	if (!ev) {
+		/* inject the packet in the Linux network stack */
+		deliver_frame(dev, buf, 3 + 1 + 1 + len - IEEE802154_FCS_LEN, acked);
+		return;
+	}
+
+	ev->len = 3 + 1 + 1 + len - IEEE802154_FCS_LEN;
+	memcpy(ev->buf, buf, ev->len);
+	sched_add(&fs->sched, ev, dev, acked ? EV_RX_DELIVER_ACKED : EV_RX_DELIVER, deliver);
+}
+
+/* the channel of a device is busy for the next us microseconds */
+void fakeserial_channel_busy(struct fakeserial_device * dev, uint16_t us) {
+	dev->busy_until = max(dev->busy_until, clock_now(&dev->fs->sched) + (uint64_t) us * USEC_TO_NSEC);
+}
+
+uint64_t fakeserial_time(const struct fakeserial * fs) {
+	return clock_now(&fs->sched);
+}
+
+void fakeserial_set_clock_offset(struct fakeserial * fs, uint64_t offset) {
+	if (offset <= fs->sched.offset)
+		return;
+
+	fs->sched.offset = offset;
+	/* the events that became due are run as soon as the timer is read */
+	sched_arm(&fs->sched);
+}
+
+uint64_t fakeserial_next_deadline(const struct fakeserial * fs) {
+	return fs->sched.nheap ? fs->sched.heap[0]->deadline : FAKESERIAL_NEVER;
+}
+
+struct fakeserial * fakeserial_new(const struct fakeserial_config * config,
+								   const struct fakeserial_ops * ops) {
+	struct fakeserial * fs;
+
+	/* pick the fastest CRC implementation and check it before any frame
+	 * goes through it */
+	if (crc16_init() < 0) {
+		fprintf(stderr, "CRC-16 self-test failed\n");
+		return NULL;
+	}
+	PRINTF("CRC-16 engine: %s\n", crc16_engine_name());
+
+	if ( !(fs = calloc(1, sizeof(*fs))) ) {
+		perror("calloc()");
+		return NULL;
+	}
+	fs->config = *config;
+	fs->config.tx_queue = min(max(config->tx_queue, 0), FAKESERIAL_TX_QUEUE_MAX);
+	fs->ops = *ops;
+
+	/* frames are released at the right time by a timer, so that neither
+	 * direction ever sleeps */
+	if (sched_init(&fs->sched) < 0) {
+		free(fs);
+		return NULL;
+	}
+
+	return fs;
+}
+
+struct fakeserial_device * fakeserial_add_device(struct fakeserial * fs, const char * name, void * ctx) {
+	struct fakeserial_device * dev, ** devices;
+
+	devices = realloc(fs->devices, (fs->ndevices + 1) * sizeof(*devices));
+	if (!devices || !(dev = calloc(1, sizeof(*dev)))) {
+		perror("unable to allocate a device");
+		if (devices)
+			fs->devices = devices;
+		return NULL;
+	}
+	fs->devices = devices;
+
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	if ( (dev->serialfd = set_serial(dev->name, fs->config.baudrate)) < 0 ||
+		 !(dev->events = sched_grow(&fs->sched, MAX_EVENTS)) ) {
+		if (dev->serialfd >= 0) {
+			close(dev->serialfd);
+			unlink(dev->name);
+		}
+		free(dev);
+		return NULL;
+	}
+
+	dev->fs = fs;
+	dev->id = fs->ndevices;
+	dev->ctx = ctx;
+	dev->parser.state = WAIT_START1;
+	dev->channel = IEEE802154_DEFAULT_CHANNEL;
+	pacer_init(&dev->tx_pacer, fs->config.datarate, fs->config.burst);
+	pacer_init(&dev->rx_pacer, fs->config.datarate, fs->config.burst);
+
+	fs->devices[fs->ndevices++] = dev;
+	return dev;
+}
+
+void fakeserial_free(struct fakeserial * fs) {
+	int i;
+
+	for (i = 0; i < fs->ndevices; i++) {
+		unlink(fs->devices[i]->name);
+		close(fs->devices[i]->serialfd);
+		free(fs->devices[i]->events);
+		free(fs->devices[i]->rxq.entries);
+		free(fs->devices[i]);
+	}
+	close(fs->sched.timerfd);
+	free(fs->sched.free_events);
+	free(fs->sched.heap);
+	free(fs->devices);
+	free(fs);
+}
+
+int fakeserial_timerfd(const struct fakeserial * fs) {
+	return fs->sched.timerfd;
+}
+
+int fakeserial_device_fd(const struct fakeserial_device * dev) {
+	return dev->serialfd;
+}
+
+int fakeserial_device_id(const struct fakeserial_device * dev) {
+	return dev->id;
+}
+
+const char * fakeserial_device_name(const struct fakeserial_device * dev) {
+	return dev->name;
+}
+
+uint8_t fakeserial_device_channel(const struct fakeserial_device * dev) {
+	return dev->channel;
+}
+
+void * fakeserial_device_ctx(const struct fakeserial_device * dev) {
+	return dev->ctx;
+}
+
+void fakeserial_device_report(const struct fakeserial_device * dev) {
+	char name[PATH_MAX + 4];
+
+	snprintf(name, sizeof(name), "%s TX", dev->name);
+	pacer_report(name, &dev->tx_pacer);
+	snprintf(name, sizeof(name), "%s RX", dev->name);
+	pacer_report(name, &dev->rx_pacer);
+	if (dev->tx_waits) {
+		fprintf(stderr, "%s TX: transmissions completed after %.1f us on average, %.1f us at most",
+				dev->name, (double) dev->tx_wait_sum / dev->tx_waits / USEC_TO_NSEC,
+				(double) dev->tx_wait_max / USEC_TO_NSEC);
+		if (dev->fs->config.tx_queue)
+			fprintf(stderr, ", %.2f frames in flight on average, %d at most (queue of %d)",
+					(double) dev->tx_depth_sum / dev->tx_waits, dev->tx_depth_max,
+					dev->fs->config.tx_queue);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "%s RX queue: %llu frames queued, %llu dropped at the tail, %llu from the head, %llu by type, "
+			"at most %u frames and %zu bytes waiting, serial port full %llu times\n",
+			dev->name, (unsigned long long) dev->rxq.queued,
+			(unsigned long long) dev->rxq.dropped_tail, (unsigned long long) dev->rxq.dropped_head,
+			(unsigned long long) dev->rxq.dropped_type, dev->rxq.frames_max, dev->rxq.bytes_max,
+			(unsigned long long) dev->rxq.full);
+	if (dev->fs->config.address_filter)
+		fprintf(stderr, "%s RX: %llu frames for another PAN, %llu for another address filtered\n",
+				dev->name, (unsigned long long) dev->filtered_pan,
+				(unsigned long long) dev->filtered_addr);
+	if (dev->fs->config.auto_ack)
+		fprintf(stderr, "%s TX: %llu acknowledgements sent by the radio, %llu sent again by the kernel dropped\n",
+				dev->name, (unsigned long long) dev->auto_acks,
+				(unsigned long long) dev->acks_suppressed);
+}
@@ -0,0 +1,176 @@
+/* Tony Cheneau <tony.cheneau@nist.gov> */
+
+/*
+* Conditions Of Use
+*
+* This software was developed by employees of the National Institute of
+* Standards and Technology (NIST), and others.
+* This software has been contributed to the public domain.
+* Pursuant to title 15 Untied States Code Section 105, works of NIST
+* employees are not subject to copyright protection in the United States
+* and are considered to be in the public domain.
+* As a result, a formal license is not needed to use this software.
+*
+* This software is provided "AS IS."
+* NIST MAKES NO WARRANTY OF ANY KIND, EXPRESS, IMPLIED
+* OR STATUTORY, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT
+* AND DATA ACCURACY.  NIST does not warrant or make any representations
+* regarding the use of the software or the results thereof, including but
+* not limited to the correctness, accuracy, reliability or usefulness of
+* this software.
+*/
+
+/*
+ libfakeserial emulates IEEE 802.15.4 serial devices (e.g. RedBee Econotag)
+ on pseudo-terminals: it speaks the serial protocol with the kernel, computes
+ the FCS of the frames the kernel sends, and paces both directions according
+ to a data rate and delays. Where the frames go is left to the program:
+ fakeserial hands them to udp-broker, a simulator may hand them to its own
+ channel model, without any socket in between.
+
+ The library never waits by itself. The program watches the file descriptor
+ of every device, for reading and writing, and the timer of the library, for
+ reading, and calls fakeserial_device_input(), fakeserial_device_output() or
+ fakeserial_run_timers() when they are ready. With level triggered
+ notifications, a device only needs to be watched for writing while
+ fakeserial_device_output_pending() is not 0. Nothing is thread safe.
+
+ Dates are nanoseconds on the clock of the library (see fakeserial_time()),
+ which is the monotonic clock unless a time master moved it forward (see
+ fakeserial_set_clock_offset()).
+*/
+
+#ifndef __LIBFAKESERIAL_H
+#define __LIBFAKESERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IEEE802154_FCS_LEN 2
+#define IEEE802154_MTU 127
+#define IEEE802154_CHANNEL_MAX 26
+#define IEEE802154_DEFAULT_CHANNEL 11
+
+/* largest number of frames in flight (see fakeserial_config.tx_queue) */
+#define FAKESERIAL_TX_QUEUE_MAX 64
+
+/* what is dropped when the RX queue of a device is full (see
+ * fakeserial_config.rx_drop) */
+#define FAKESERIAL_DROP_TAIL 0 /* the frame just received */
+#define FAKESERIAL_DROP_HEAD 1 /* the oldest frames waiting */
+#define FAKESERIAL_DROP_TYPE 2 /* the oldest frames of the types in rx_drop_types */
+
+/* no event is pending (see fakeserial_next_deadline()) */
+#define FAKESERIAL_NEVER UINT64_MAX
+
+struct fakeserial;
+struct fakeserial_device;
+
+struct fakeserial_config {
+	int baudrate; /* of the pseudo-terminals: 115200 or 921600 */
+	unsigned long datarate; /* in bit per seconds, 0 when unbounded */
+	unsigned long burst; /* bytes sent back to back when the data rate is bounded */
+	uint64_t delay_tx; /* from the kernel to on_tx_frame(), in nanoseconds */
+	uint64_t delay_rx; /* from fakeserial_inject_rx_frame() to the kernel */
+	/* drop the received frames whose destination PAN or address is not the
+	 * one the kernel set, as the address recognition of a transceiver does */
+	int address_filter;
+	/* acknowledge the frames sent to the device that request it, without
+	 * waiting for the kernel, whose own acknowledgements are then dropped.
+	 * Only the frames the RX queue accepts are acknowledged, and they are
+	 * then never dropped from it */
+	int auto_ack;
+	/* number of frames the kernel may hand over while the previous ones are
+	 * still waiting for their TX delay or being transmitted (at most
+	 * FAKESERIAL_TX_QUEUE_MAX). The kernel is told a frame is sent as soon as
+	 * it is accepted, or when the oldest frame in flight leaves the radio if
+	 * there are already that many. 0 tells it at the end of each frame */
+	int tx_queue;
+	/* the received frames wait in a queue while the kernel does not read the
+	 * serial port, of at most rx_queue_frames frames and rx_queue_bytes bytes
+	 * (0 when unbounded, the bytes counting the serial protocol). When it is
+	 * full, rx_drop (FAKESERIAL_DROP_*) picks the frames dropped, and with
+	 * FAKESERIAL_DROP_TYPE, the types of the frames dropped first are the
+	 * bits set in rx_drop_types (1 << MAC frame type). The frame just
+	 * received is dropped when no other frame makes room for it */
+	unsigned int rx_queue_frames;
+	size_t rx_queue_bytes;
+	int rx_drop;
+	unsigned int rx_drop_types;
+};
+
+struct fakeserial_ops {
+	/* a device transmits a frame (FCS included), once its TX delay and its
+	 * data rate allow it */
+	void (*on_tx_frame)(struct fakeserial_device * dev, const uint8_t * frame, uint8_t len);
+	/* a transmission ends and the kernel is about to be told: the frames
+	 * passed to on_tx_frame() must have left (optional) */
+	void (*on_tx_done)(struct fakeserial_device * dev);
+	/* the kernel changed the channel of a device (optional) */
+	void (*on_set_channel)(struct fakeserial_device * dev);
+};
+
+/* returns NULL if the CRC engine fails its self-test or on allocation
+ * failure */
+struct fakeserial * fakeserial_new(const struct fakeserial_config * config,
+								   const struct fakeserial_ops * ops);
+/* removes the serial ports */
+void fakeserial_free(struct fakeserial * fs);
+
+/* create a serial port, name being the symbolic link to the pseudo-terminal
+ * (e.g. /dev/fakeserial0). ctx is left to the program.
+ * returns NULL on failure */
+struct fakeserial_device * fakeserial_add_device(struct fakeserial * fs, const char * name, void * ctx);
+
+/* the timer that releases the delayed and paced frames */
+int fakeserial_timerfd(const struct fakeserial * fs);
+void fakeserial_run_timers(struct fakeserial * fs);
+
+/* date on the monotonic clock */
+uint64_t fakeserial_now(void);
+/* date on the clock of the library */
+uint64_t fakeserial_time(const struct fakeserial * fs);
+/* run the clock of the library offset nanoseconds ahead of the monotonic
+ * clock, so that a simulation skips the periods during which nothing
+ * happens. The clock never goes back: a smaller offset is ignored. The
+ * events that became due are run by the next fakeserial_run_timers() call
+ * (the timer expires right away) */
+void fakeserial_set_clock_offset(struct fakeserial * fs, uint64_t offset);
+/* date of the next pending event (frame to send, to deliver or
+ * transmission to complete), FAKESERIAL_NEVER when there is none */
+uint64_t fakeserial_next_deadline(const struct fakeserial * fs);
+
+/* the pseudo-terminal of a device */
+int fakeserial_device_fd(const struct fakeserial_device * dev);
+/* process the commands sent by the kernel.
+ * returns 1 when the pseudo-terminal was created again (the kernel side was
+ * closed), and its new file descriptor has to be watched */
+int fakeserial_device_input(struct fakeserial_device * dev);
+/* write what waits in the RX queue (received frames and responses to the
+ * commands), once the pseudo-terminal can take more bytes */
+void fakeserial_device_output(struct fakeserial_device * dev);
+/* number of bytes waiting in the RX queue */
+size_t fakeserial_device_output_pending(const struct fakeserial_device * dev);
+
+/* hand a frame (FCS included, not checked) to a device, which the remote
+ * radio started to send at date sent (on the clock of the library). The frame reaches the kernel at the
+ * end of its reception and after the RX delay */
+void fakeserial_inject_rx_frame(struct fakeserial_device * dev, const uint8_t * frame, uint8_t len,
+								uint8_t lqi, uint64_t sent);
+/* another radio transmits on the channel of a device for the next us
+ * microseconds (CCA and ED report it) */
+void fakeserial_channel_busy(struct fakeserial_device * dev, uint16_t us);
+
+int fakeserial_device_id(const struct fakeserial_device * dev);
+const char * fakeserial_device_name(const struct fakeserial_device * dev);
+uint8_t fakeserial_device_channel(const struct fakeserial_device * dev);
+void * fakeserial_device_ctx(const struct fakeserial_device * dev);
+
+/* print the frames sent and received by a device, the achieved data rates,
+ * how long the kernel waits for the end of its transmissions, the frames
+ * queued and dropped on the way to the kernel, the frames dropped by the
+ * address filter and the acknowledgements sent by the radio, on stderr */
+void fakeserial_device_report(const struct fakeserial_device * dev);
+
+#endif /* __LIBFAKESERIAL_H */
@@ -0,0 +1,129 @@
+/*
+ This file decodes the header of the IEEE 802.15.4 MAC frames (frame
+ control, sequence number and addressing fields), for udp-broker and
+ fakeserial to tell where a frame goes without handing it to a full MAC
+ layer.
+
+ Layout (multi-byte fields little endian):
+
+	 0  frame control (16 bits):
+	    bits 0-2 frame type, 3 security enabled, 4 frame pending,
+	    5 ACK request, 6 PAN ID compression, 10-11 destination addressing
+	    mode, 12-13 frame version, 14-15 source addressing mode
+	 2  sequence number
+	 3  destination PAN ID (2, when there is a destination address)
+	    destination address (0, 2 or 8)
+	    source PAN ID (2, when there is a source address and the PAN ID
+	    compression bit is not set)
+	    source address (0, 2 or 8)
+
+ Only the frame versions of IEEE 802.15.4-2003 and 2006 are decoded: the
+ PAN ID compression rules of the 2015 version differ, and these frames are
+ handled as if their header could not be read.
+*/
+
+#ifndef __MAC802154_H
+#define __MAC802154_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MAC_FRAME_BEACON 0
+#define MAC_FRAME_DATA 1
+#define MAC_FRAME_ACK 2
+#define MAC_FRAME_COMMAND 3
+
+#define MAC_ADDR_NONE 0
+#define MAC_ADDR_SHORT 2
+#define MAC_ADDR_LONG 3
+
+#define MAC_BROADCAST 0xffff /* short address and PAN ID */
+
+#define MAC_FCF_SECURITY 0x0008
+#define MAC_FCF_PENDING 0x0010
+#define MAC_FCF_ACK_REQUEST 0x0020
+#define MAC_FCF_PANID_COMPRESSION 0x0040
+
+struct mac_header {
+	uint16_t fcf;
+	uint8_t type;
+	uint8_t version;
+	uint8_t seq;
+	uint8_t dst_mode;
+	uint8_t src_mode;
+	uint16_t dst_pan; /* MAC_BROADCAST when there is no destination */
+	uint16_t src_pan; /* the destination PAN ID with PAN ID compression */
+	uint64_t dst; /* a short address takes the low 16 bits */
+	uint64_t src;
+	uint8_t len; /* length of the header */
+};
+
+static inline uint64_t mac_get(const uint8_t * p, int len) {
+	uint64_t v = 0;
+
+	while (len--)
+		v = v << 8 | p[len];
+
+	return v;
+}
+
+static inline int mac_addr_len(uint8_t mode) {
+	return mode == MAC_ADDR_SHORT ? 2 : mode == MAC_ADDR_LONG ? 8 : 0;
+}
+
+/* decode the header of a frame (FCS excluded or not).
+ * returns -1 if the frame is too short for its header, or if the header
+ * uses a reserved addressing mode or a frame version that is not decoded */
+static inline int mac_parse(const uint8_t * frame, size_t len, struct mac_header * h) {
+	size_t need = 3;
+	const uint8_t * p;
+
+	if (len < need)
+		return -1;
+
+	memset(h, 0, sizeof(*h));
+	h->fcf = frame[0] | frame[1] << 8;
+	h->type = h->fcf & 0x7;
+	h->dst_mode = (h->fcf >> 10) & 0x3;
+	h->version = (h->fcf >> 12) & 0x3;
+	h->src_mode = (h->fcf >> 14) & 0x3;
+	h->seq = frame[2];
+	h->dst_pan = h->src_pan = MAC_BROADCAST;
+
+	if (h->dst_mode == 1 || h->src_mode == 1 || h->version > 1)
+		return -1;
+
+	/* check the length once, before reading any address */
+	if (h->dst_mode)
+		need += 2 + mac_addr_len(h->dst_mode);
+	if (h->src_mode)
+		need += ((h->fcf & MAC_FCF_PANID_COMPRESSION) && h->dst_mode ? 0 : 2) + mac_addr_len(h->src_mode);
+	if (len < need)
+		return -1;
+
+	p = frame + 3;
+	if (h->dst_mode) {
+		h->dst_pan = h->src_pan = mac_get(p, 2);
+		h->dst = mac_get(p + 2, mac_addr_len(h->dst_mode));
+		p += 2 + mac_addr_len(h->dst_mode);
+	}
+	if (h->src_mode) {
+		if (!(h->fcf & MAC_FCF_PANID_COMPRESSION) || !h->dst_mode) {
+			h->src_pan = mac_get(p, 2);
+			p += 2;
+		}
+		h->src = mac_get(p, mac_addr_len(h->src_mode));
+		p += mac_addr_len(h->src_mode);
+	}
+	h->len = p - frame;
+
+	return 0;
+}
+
+/* is the destination a single device */
+static inline int mac_is_unicast(const struct mac_header * h) {
+	return h->dst_mode == MAC_ADDR_LONG ||
+		(h->dst_mode == MAC_ADDR_SHORT && h->dst != MAC_BROADCAST);
+}
+
+#endif /* __MAC802154_H */
@@ -0,0 +1,95 @@
+/*
+ This file defines the shared memory transport between fakeserial and
+ udp-broker, for the processes that run on the same host.
+
+ The broker listens on an abstract unix socket named after the transport
+ (e.g. "shm:/phy" listens on "@udp-broker/phy"). A fakeserial process
+ creates a memory file (memfd) holding one ring per direction and two
+ eventfds, one to wake up each side, and passes them to the broker along
+ with its HELLO (see encap.h), as SCM_RIGHTS ancillary data. The broker
+ answers the HELLO on the socket, and the frames then only go through the
+ rings. Closing the socket detaches the client.
+
+ Every ring has a single producer and a single consumer, and holds
+ fixed-size slots: a slot is a datagram, as it would have been sent over
+ UDP (header included). The producer only signals the eventfd when the
+ ring was empty, as the consumer drains the ring before it waits again.
+*/
+
+#ifndef __SHMRING_H
+#define __SHMRING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_PREFIX "shm:"
+#define SHM_SOCKET_PREFIX "udp-broker" /* followed by the name, e.g. "/phy" */
+#define SHM_RING_SLOTS 1024 /* a power of two */
+#define SHM_SLOT_SIZE 256
+#define SHM_FRAME_MAX (SHM_SLOT_SIZE - 2)
+
+/* file descriptors passed along with the HELLO, in this order */
+#define SHM_FD_AREA 0 /* the memfd */
+#define SHM_FD_TO_BROKER 1 /* eventfd signaled by the client */
+#define SHM_FD_TO_CLIENT 2 /* eventfd signaled by the broker */
+#define SHM_NFDS 3
+
+struct shm_slot {
+	uint16_t len;
+	uint8_t data[SHM_FRAME_MAX];
+};
+
+struct shm_ring {
+	uint32_t head; /* next slot to be written, by the producer */
+	uint8_t pad1[60];
+	uint32_t tail; /* next slot to be read, by the consumer */
+	uint8_t pad2[60];
+	struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+struct shm_area {
+	struct shm_ring to_broker;
+	struct shm_ring to_client;
+};
+
+/* write a datagram made of an optional prefix and a buffer.
+ * returns -1 if the ring is full (or the datagram too long), 1 if the
+ * consumer has to be woken up, 0 otherwise */
+static inline int shm_ring_push(struct shm_ring * r, const void * prefix, size_t plen,
+								const void * buf, size_t len) {
+	uint32_t head = r->head;
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+	struct shm_slot * slot;
+
+	if (head - tail == SHM_RING_SLOTS || plen + len > SHM_FRAME_MAX)
+		return -1;
+
+	slot = &r->slots[head & (SHM_RING_SLOTS - 1)];
+	memcpy(slot->data, prefix, plen);
+	memcpy(slot->data + plen, buf, len);
+	slot->len = plen + len;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+
+	/* the consumer may have emptied the ring since tail was read */
+	return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+/* read the next datagram into buf, truncated to size bytes as recv() would.
+ * returns its length, or -1 if the ring is empty */
+static inline int shm_ring_pop(struct shm_ring * r, void * buf, size_t size) {
+	uint32_t tail = r->tail;
+	struct shm_slot * slot;
+	int len;
+
+	if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail)
+		return -1;
+
+	slot = &r->slots[tail & (SHM_RING_SLOTS - 1)];
+	len = slot->len < size ? slot->len : size;
+	memcpy(buf, slot->data, len);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	return len;
+}
+
+#endif /* __SHMRING_H */
@@ -0,0 +1,449 @@
+/*
+ Integration tests of fakeserial and udp-broker (make check). Each case
+ starts a broker and a few fakeserial processes of its own, on ports of its
+ own, and plays the kernel on their pseudo-terminals: it sends frames with
+ the TX_BLOCK command, and parses the RX_BLOCK responses the devices write.
+
+ The tests run from the top of the tree, once fakeserial and udp-broker are
+ built. The exit status is the number of failed checks.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BROKER "./udp-broker"
+#define FAKESERIAL "./fakeserial"
+#define PORT_BASE 47300 /* every case uses the ten ports from PORT_BASE + 10 * case */
+
+#define MAX_PROCS 8
+#define MAX_FRAMES 2048
+#define FRAME_MAX 127
+
+/* serial protocol (see libfakeserial.c) */
+#define START_BYTE1 'z'
+#define START_BYTE2 'b'
+#define TX_BLOCK 0x09
+#define TX_BLOCK_RESPONSE 0x89
+#define RX_BLOCK 0x8b
+
+#define SETTLE_MS 300 /* for the processes to start and the HELLO to be answered */
+#define QUIET_MS 300 /* a device received everything once it is quiet that long */
+
+/* the kernel side of a device */
+struct device {
+	const char * name;
+	int fd;
+	uint8_t buf[4096];
+	size_t used;
+	unsigned long tx_done;
+	/* frames received, without their FCS */
+	int nframes;
+	uint8_t len[MAX_FRAMES];
+	uint8_t frames[MAX_FRAMES][FRAME_MAX];
+};
+
+static pid_t procs[MAX_PROCS];
+static int nprocs;
+static const char * current; /* name of the running case */
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s: ", current); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+static void sleep_ms(int ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/* start a program, its output going to /dev/null unless V is set */
+static void spawn(char * const argv[]) {
+	pid_t pid;
+	int null;
+
+	if (nprocs == MAX_PROCS) {
+		fprintf(stderr, "too many processes\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ( (pid = fork()) < 0 ) {
+		perror("fork()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!pid) {
+		if (!getenv("V") && (null = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	procs[nprocs++] = pid;
+}
+
+static void stop_all(void) {
+	int i;
+
+	for (i = 0; i < nprocs; i++) {
+		kill(procs[i], SIGKILL);
+		waitpid(procs[i], NULL, 0);
+	}
+	nprocs = 0;
+}
+
+static void start_broker(int port, char * option) {
+	char lport[8];
+	char * argv[] = { BROKER, "-l", lport, option, NULL };
+
+	snprintf(lport, sizeof(lport), "%d", port);
+	spawn(argv);
+	sleep_ms(200);
+}
+
+/* start a fakeserial process with a single device. option, if any, is
+ * followed by its value */
+static void start_fakeserial(struct device * dev, const char * name, int lport, int port,
+							 char * option, char * value) {
+	char local[8], remote[8];
+	char * argv[] = { FAKESERIAL, "-n", (char *) name, "-u", "127.0.0.1", "-s", local, "-r", remote,
+					  option, value, NULL };
+
+	memset(dev, 0, sizeof(*dev));
+	dev->name = name;
+	dev->fd = -1;
+	unlink(name);
+	snprintf(local, sizeof(local), "%d", lport);
+	snprintf(remote, sizeof(remote), "%d", port);
+	spawn(argv);
+}
+
+/* open the pseudo-terminal of a device as the kernel would */
+static int device_open(struct device * dev) {
+	struct termios tio;
+	int i;
+
+	for (i = 0; i < 100 && access(dev->name, F_OK) < 0; i++)
+		sleep_ms(50);
+
+	if ( (dev->fd = open(dev->name, O_RDWR | O_NOCTTY)) < 0 ) {
+		perror(dev->name);
+		return -1;
+	}
+
+	tcgetattr(dev->fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(dev->fd, TCSANOW, &tio);
+	return 0;
+}
+
+static void device_close(struct device * dev) {
+	if (dev->fd >= 0)
+		close(dev->fd);
+	unlink(dev->name);
+}
+
+/* take the complete responses out of the buffer of a device */
+static void device_parse(struct device * dev) {
+	size_t off = 0, need;
+
+	while (dev->used - off >= 4) {
+		uint8_t * p = dev->buf + off;
+
+		if (p[0] != START_BYTE1 || p[1] != START_BYTE2) {
+			off++;
+			continue;
+		}
+
+		need = p[2] == RX_BLOCK ? 5 + (size_t) p[4] : 4;
+		if (dev->used - off < need)
+			break;
+
+		if (p[2] == RX_BLOCK) {
+			if (dev->nframes < MAX_FRAMES) {
+				dev->len[dev->nframes] = p[4];
+				memcpy(dev->frames[dev->nframes], p + 5, p[4]);
+				dev->nframes++;
+			}
+		} else if (p[2] == TX_BLOCK_RESPONSE)
+			dev->tx_done++;
+
+		off += need;
+	}
+
+	memmove(dev->buf, dev->buf + off, dev->used - off);
+	dev->used -= off;
+}
+
+/* read what a device writes, until it stays quiet for ms milliseconds */
+static void device_drain(struct device * dev, int ms) {
+	struct pollfd pfd = { dev->fd, POLLIN, 0 };
+	ssize_t n;
+
+	while (poll(&pfd, 1, ms) > 0) {
+		if ( (n = read(dev->fd, dev->buf + dev->used, sizeof(dev->buf) - dev->used)) <= 0 )
+			break;
+		dev->used += n;
+		device_parse(dev);
+	}
+}
+
+/* hand a frame (without FCS) to a device */
+static void device_write(struct device * dev, const uint8_t * frame, uint8_t len) {
+	uint8_t cmd[3 + 1 + FRAME_MAX] = { START_BYTE1, START_BYTE2, TX_BLOCK, len };
+
+	memcpy(cmd + 4, frame, len);
+	if (write(dev->fd, cmd, 4 + len) != 4 + len)
+		perror("write()");
+}
+
+/* wait until a device told that count frames were sent */
+static int device_wait_tx(struct device * dev, unsigned long count) {
+	struct pollfd pfd = { dev->fd, POLLIN, 0 };
+	ssize_t n;
+
+	while (dev->tx_done < count) {
+		if (poll(&pfd, 1, 2000) <= 0 ||
+			(n = read(dev->fd, dev->buf + dev->used, sizeof(dev->buf) - dev->used)) <= 0)
+			return -1;
+		dev->used += n;
+		device_parse(dev);
+	}
+
+	return 0;
+}
+
+static int device_send(struct device * dev, const uint8_t * frame, uint8_t len) {
+	device_write(dev, frame, len);
+	return device_wait_tx(dev, dev->tx_done + 1);
+}
+
+/* a data frame within PAN 0xabcd, with short addresses. The payload starts
+ * with a number identifying the frame */
+static uint8_t make_frame(uint8_t * f, uint16_t dst, uint16_t src, uint16_t id, uint8_t payload) {
+	uint8_t i;
+
+	f[0] = 0x41; /* data, PAN ID compression */
+	f[1] = 0x88; /* short addresses */
+	f[2] = id & 0xff;
+	f[3] = 0xcd;
+	f[4] = 0xab;
+	f[5] = dst & 0xff;
+	f[6] = dst >> 8;
+	f[7] = src & 0xff;
+	f[8] = src >> 8;
+	f[9] = id & 0xff;
+	f[10] = id >> 8;
+	for (i = 2; i < payload; i++)
+		f[9 + i] = i;
+
+	return 9 + payload;
+}
+
+static int frame_id(const struct device * dev, int i) {
+	return dev->frames[i][9] | dev->frames[i][10] << 8;
+}
+
+/* the frames of a device reach the other ones, untouched, and not itself */
+static void test_delivery(int port) {
+	struct device a, b;
+	uint8_t f[FRAME_MAX], len;
+
+	start_broker(port, NULL);
+	start_fakeserial(&a, "/tmp/fakeserial-check-a", port + 1, port, NULL, NULL);
+	start_fakeserial(&b, "/tmp/fakeserial-check-b", port + 2, port, NULL, NULL);
+	if (device_open(&a) < 0 || device_open(&b) < 0)
+		goto out;
+	sleep_ms(SETTLE_MS);
+
+	len = make_frame(f, 0xffff, 1, 1, 20);
+	CHECK(device_send(&a, f, len) == 0, "no TX_BLOCK response");
+	device_drain(&b, QUIET_MS);
+	device_drain(&a, 0);
+
+	CHECK(b.nframes == 1, "%d frames received instead of 1", b.nframes);
+	CHECK(b.nframes < 1 || (b.len[0] == len && memcmp(b.frames[0], f, len) == 0),
+		  "the frame changed on the way");
+	CHECK(a.nframes == 0, "the sender received its own frame");
+
+out:
+	stop_all();
+	device_close(&a);
+	device_close(&b);
+}
+
+/* a unicast frame only reaches its destination, once the broker learned
+ * where the addresses are (udp-broker without -m) */
+static void test_unicast(int port) {
+	struct device a, b, c;
+	uint8_t f[FRAME_MAX], len;
+
+	start_broker(port, NULL);
+	start_fakeserial(&a, "/tmp/fakeserial-check-a", port + 1, port, NULL, NULL);
+	start_fakeserial(&b, "/tmp/fakeserial-check-b", port + 2, port, NULL, NULL);
+	start_fakeserial(&c, "/tmp/fakeserial-check-c", port + 3, port, NULL, NULL);
+	if (device_open(&a) < 0 || device_open(&b) < 0 || device_open(&c) < 0)
+		goto out;
+	sleep_ms(SETTLE_MS);
+
+	/* the broker learns the addresses from the frames they send */
+	len = make_frame(f, 0xffff, 2, 1, 10);
+	CHECK(device_send(&b, f, len) == 0, "no TX_BLOCK response");
+	len = make_frame(f, 0xffff, 3, 2, 10);
+	CHECK(device_send(&c, f, len) == 0, "no TX_BLOCK response");
+	device_drain(&a, QUIET_MS);
+	device_drain(&b, 0);
+	device_drain(&c, 0);
+	CHECK(a.nframes == 2, "%d broadcast frames received instead of 2", a.nframes);
+	a.nframes = b.nframes = c.nframes = 0;
+
+	len = make_frame(f, 2, 1, 3, 10);
+	CHECK(device_send(&a, f, len) == 0, "no TX_BLOCK response");
+	device_drain(&b, QUIET_MS);
+	device_drain(&c, 0);
+
+	CHECK(b.nframes == 1 && frame_id(&b, 0) == 3, "the destination received %d frames instead of 1",
+		  b.nframes);
+	CHECK(c.nframes == 0, "another device received a unicast frame");
+
+out:
+	stop_all();
+	device_close(&a);
+	device_close(&b);
+	device_close(&c);
+}
+
+/* with the collision engine (udp-broker -c), frames overlapping at a
+ * receiver are lost there, while a frame alone still goes through */
+static void test_collision(int port) {
+	struct device a, b, c;
+	uint8_t f[FRAME_MAX], g[FRAME_MAX], flen, glen;
+
+	start_broker(port, "-c");
+	start_fakeserial(&a, "/tmp/fakeserial-check-a", port + 1, port, NULL, NULL);
+	start_fakeserial(&b, "/tmp/fakeserial-check-b", port + 2, port, NULL, NULL);
+	start_fakeserial(&c, "/tmp/fakeserial-check-c", port + 3, port, NULL, NULL);
+	if (device_open(&a) < 0 || device_open(&b) < 0 || device_open(&c) < 0)
+		goto out;
+	sleep_ms(SETTLE_MS);
+
+	flen = make_frame(f, 0xffff, 1, 1, 100);
+	CHECK(device_send(&a, f, flen) == 0, "no TX_BLOCK response");
+	device_drain(&c, QUIET_MS);
+	device_drain(&b, 0);
+	CHECK(c.nframes == 1, "a frame alone: %d frames received instead of 1", c.nframes);
+	a.nframes = b.nframes = c.nframes = 0;
+
+	/* about 4 ms of airtime each: the two frames overlap */
+	flen = make_frame(f, 0xffff, 1, 2, 110);
+	glen = make_frame(g, 0xffff, 2, 3, 110);
+	device_write(&a, f, flen);
+	device_write(&b, g, glen);
+	CHECK(device_wait_tx(&a, a.tx_done + 1) == 0 && device_wait_tx(&b, b.tx_done + 1) == 0,
+		  "no TX_BLOCK response");
+	device_drain(&c, QUIET_MS);
+	device_drain(&a, 0);
+	device_drain(&b, 0);
+
+	CHECK(c.nframes == 0, "%d colliding frames received", c.nframes);
+	CHECK(a.nframes == 0 && b.nframes == 0, "a device received a frame while sending");
+
+out:
+	stop_all();
+	device_close(&a);
+	device_close(&b);
+	device_close(&c);
+}
+
+/* a device whose kernel does not read keeps at most -R frames waiting, and
+ * drops the new ones (-P tail) or the oldest ones (-P head) */
+static void test_rx_queue(int port, char * policy) {
+	const int count = 1500; /* more than the pseudo-terminal holds */
+	struct device a, b;
+	uint8_t f[FRAME_MAX], len;
+	int i, contiguous;
+
+	start_broker(port, NULL);
+	start_fakeserial(&a, "/tmp/fakeserial-check-a", port + 1, port, NULL, NULL);
+	start_fakeserial(&b, "/tmp/fakeserial-check-b", port + 2, port, "-P", policy);
+	if (device_open(&a) < 0 || device_open(&b) < 0)
+		goto out;
+	sleep_ms(SETTLE_MS);
+
+	for (i = 0; i < count; i++) {
+		len = make_frame(f, 0xffff, 1, i, 110);
+		if (device_send(&a, f, len) < 0) {
+			CHECK(0, "no TX_BLOCK response for frame %d", i);
+			goto out;
+		}
+	}
+	sleep_ms(100);
+	device_drain(&b, QUIET_MS);
+
+	for (i = 1, contiguous = 1; i < b.nframes; i++)
+		if (frame_id(&b, i) != frame_id(&b, i - 1) + 1)
+			contiguous = 0;
+
+	CHECK(b.nframes > 0 && b.nframes < count, "%d frames received out of %d", b.nframes, count);
+	if (b.nframes <= 0)
+		goto out;
+	CHECK(frame_id(&b, 0) == 0, "the first frame received is %d", frame_id(&b, 0));
+	if (!strcmp(policy, "tail"))
+		CHECK(contiguous && frame_id(&b, b.nframes - 1) < count - 1,
+			  "the frames after the queue filled up were not the ones dropped");
+	else
+		CHECK(!contiguous && frame_id(&b, b.nframes - 1) == count - 1,
+			  "the oldest frames waiting were not the ones dropped");
+
+out:
+	stop_all();
+	device_close(&a);
+	device_close(&b);
+}
+
+int main(void) {
+	if (access(BROKER, X_OK) < 0 || access(FAKESERIAL, X_OK) < 0) {
+		fprintf(stderr, "run from the top of the tree, after make\n");
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	current = "delivery";
+	test_delivery(PORT_BASE);
+	current = "unicast";
+	test_unicast(PORT_BASE + 10);
+	current = "collision";
+	test_collision(PORT_BASE + 20);
+	current = "rx queue tail";
+	test_rx_queue(PORT_BASE + 30, "tail");
+	current = "rx queue head";
+	test_rx_queue(PORT_BASE + 40, "head");
+
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	else
+		printf("all checks passed\n");
+
+	return failures;
+}
@@ -82,7 +82,7 @@ static const uint16_t crctable[256] =
 /* following code public domain
  * it's slightly modified from the original from J. Zbiciak (2001) to use
  * standard types + reflected table   */
-uint16_t crc16_block(uint16_t crc, uint8_t *data, int len) {
+static uint16_t crc16_bytewise(uint16_t crc, const uint8_t *data, int len) {
     int i;
 
     for (i = 0; i < len; i++)
@@ -90,3 +90,250 @@ uint16_t crc16_block(uint16_t crc, uint8_t *data, int len) {
 
     return crc;
 }
+
+/* slice-by-8: crcslice[k][b] is the contribution of byte b followed by k
+ * zero bytes, so that eight input bytes are folded with eight independent
+ * lookups. crcslice[0] is crctable. The tables are built by crc16_init() */
+static uint16_t crcslice[8][256];
+
+static uint16_t crc16_slice8(uint16_t crc, const uint8_t *data, int len) {
+    while (len >= 8) {
+        crc ^= data[0] | (data[1] << 8);
+        crc = crcslice[7][crc & 0xFF] ^ crcslice[6][crc >> 8] ^
+              crcslice[5][data[2]] ^ crcslice[4][data[3]] ^
+              crcslice[3][data[4]] ^ crcslice[2][data[5]] ^
+              crcslice[1][data[6]] ^ crcslice[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+
+    return crc16_bytewise(crc, data, len);
+}
+
+/* slice-by-4: the same folding over four bytes, with half of the tables
+ * (2 KB instead of 4 KB of cache) */
+static uint16_t crc16_slice4(uint16_t crc, const uint8_t *data, int len) {
+    while (len >= 4) {
+        crc ^= data[0] | (data[1] << 8);
+        crc = crcslice[3][crc & 0xFF] ^ crcslice[2][crc >> 8] ^
+              crcslice[1][data[2]] ^ crcslice[0][data[3]];
+        data += 4;
+        len -= 4;
+    }
+
+    return crc16_bytewise(crc, data, len);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(CRC16_NO_CLMUL)
+#define HAVE_CRC16_CLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* folding constants, in the bit-reflected domain: a 16 bytes block is
+ * folded 128 bits forward by multiplying its low half by x^191 mod P and
+ * its high half by x^127 mod P (computed by crc16_init()) */
+static uint64_t clmul_k1, clmul_k2;
+
+/* reduce x^n modulo the (non-reflected) generator polynomial, and return
+ * it in the reflected 64 bits representation used by the clmul kernel */
+static uint64_t xpow_mod_reflected(unsigned n) {
+    uint32_t r = 1;
+    uint64_t k = 0;
+    int i;
+
+    while (n--) {
+        r <<= 1;
+        if (r & 0x10000)
+            r ^= 0x11021;
+    }
+
+    for (i = 0; i < 16; i++)
+        if (r & (1 << i))
+            k |= (uint64_t) 1 << (63 - i);
+
+    return k;
+}
+
+#define CLMUL_FOLD(x, k) _mm_xor_si128(_mm_clmulepi64_si128((x), (k), 0x00), \
+                                       _mm_clmulepi64_si128((x), (k), 0x11))
+
+/* carry-less multiply kernel. Buffers shorter than two blocks do not
+ * amortize the setup and go through the slice-by-8 code */
+__attribute__((target("pclmul,sse2")))
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *data, int len) {
+    __m128i x, k;
+    uint8_t folded[16];
+
+    if (len < 32)
+        return crc16_slice8(crc, data, len);
+
+    k = _mm_set_epi64x(clmul_k2, clmul_k1);
+    x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) data),
+                      _mm_cvtsi32_si128(crc));
+    data += 16;
+    len -= 16;
+
+    while (len >= 16) {
+        x = _mm_xor_si128(CLMUL_FOLD(x, k),
+                          _mm_loadu_si128((const __m128i *) data));
+        data += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *) folded, x);
+    crc = crc16_slice8(0, folded, 16);
+    return crc16_slice8(crc, data, len);
+}
+
+/* four frames are folded in lockstep, so that the latency of one
+ * multiplication is hidden behind the other three */
+__attribute__((target("pclmul,sse2")))
+static void crc16_clmul_multi(uint8_t * const *data, const int *len,
+                              uint16_t *crc, int count) {
+    __m128i x[4], k;
+    uint8_t folded[16];
+    int i, j, n, off;
+
+    k = _mm_set_epi64x(clmul_k2, clmul_k1);
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        n = len[i];
+        for (j = 1; j < 4; j++)
+            if (len[i + j] < n)
+                n = len[i + j];
+
+        if (n < 32) {
+            for (j = 0; j < 4; j++)
+                crc[i + j] = crc16_clmul(crc[i + j], data[i + j], len[i + j]);
+            continue;
+        }
+
+        for (j = 0; j < 4; j++)
+            x[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) data[i + j]),
+                                 _mm_cvtsi32_si128(crc[i + j]));
+
+        for (off = 16; off + 16 <= n; off += 16)
+            for (j = 0; j < 4; j++)
+                x[j] = _mm_xor_si128(CLMUL_FOLD(x[j], k),
+                                     _mm_loadu_si128((const __m128i *) (data[i + j] + off)));
+
+        for (j = 0; j < 4; j++) {
+            _mm_storeu_si128((__m128i *) folded, x[j]);
+            crc[i + j] = crc16_slice8(0, folded, 16);
+            crc[i + j] = crc16_clmul(crc[i + j], data[i + j] + off, len[i + j] - off);
+        }
+    }
+
+    for (; i < count; i++)
+        crc[i] = crc16_clmul(crc[i], data[i], len[i]);
+}
+#endif /* HAVE_CRC16_CLMUL */
+
+struct crc16_engine {
+    const char *name;
+    uint16_t (*block)(uint16_t crc, const uint8_t *data, int len);
+};
+
+/* candidates, from the fastest to the reference implementation */
+static const struct crc16_engine crc16_engines[] = {
+#ifdef HAVE_CRC16_CLMUL
+    { "pclmulqdq", crc16_clmul },
+#endif
+    { "slice-by-8", crc16_slice8 },
+    { "slice-by-4", crc16_slice4 },
+    { "bytewise", crc16_bytewise },
+};
+#define CRC16_NENGINES (sizeof(crc16_engines) / sizeof(crc16_engines[0]))
+
+/* the byte loop is used until crc16_init() selects something better */
+static const struct crc16_engine *crc16_engine = &crc16_engines[CRC16_NENGINES - 1];
+
+uint16_t crc16_block(uint16_t crc, uint8_t *data, int len) {
+    return crc16_engine->block(crc, data, len);
+}
+
+void crc16_block_multi(uint8_t * const *data, const int *len, uint16_t *crc, int count) {
+    int i;
+
+#ifdef HAVE_CRC16_CLMUL
+    if (crc16_engine->block == crc16_clmul) {
+        crc16_clmul_multi(data, len, crc, count);
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++)
+        crc[i] = crc16_engine->block(crc[i], data[i], len[i]);
+}
+
+const char * crc16_engine_name(void) {
+    return crc16_engine->name;
+}
+
+/* the standard writes bits in transmission order, least significant first */
+static uint16_t bitrev(uint16_t v, int width) {
+    uint16_t r = 0;
+    int i;
+
+    for (i = 0; i < width; i++)
+        if (v & (1 << i))
+            r |= 1 << (width - 1 - i);
+
+    return r;
+}
+
+/* check an engine against the test vector of the standard, and against the
+ * byte loop over a pseudo-random buffer exercising every code path */
+static int crc16_selftest(const struct crc16_engine *e) {
+    static const uint8_t test_vec[3] = { 0x40, 0x00, 0x56 };
+    static const uint16_t test_crc = 0x279E;
+    uint8_t buf[300];
+    uint32_t seed = 0x802154;
+    int i;
+
+    for (i = 0; i < (int) sizeof(test_vec); i++)
+        buf[i] = bitrev(test_vec[i], 8);
+    if (e->block(0, buf, sizeof(test_vec)) != bitrev(test_crc, 16))
+        return -1;
+
+    for (i = 0; i < (int) sizeof(buf); i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+
+    for (i = 0; i < (int) sizeof(buf); i += 7)
+        if (e->block(i, buf + i % 13, sizeof(buf) - i % 13 - i / 2) !=
+            crc16_bytewise(i, buf + i % 13, sizeof(buf) - i % 13 - i / 2))
+            return -1;
+
+    return 0;
+}
+
+int crc16_init(void) {
+    unsigned i, k;
+#ifdef HAVE_CRC16_CLMUL
+    unsigned eax, ebx, ecx, edx;
+    int have_clmul = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL);
+
+    clmul_k1 = xpow_mod_reflected(191);
+    clmul_k2 = xpow_mod_reflected(127);
+#endif
+
+    for (i = 0; i < 256; i++)
+        crcslice[0][i] = crctable[i];
+    for (k = 1; k < 8; k++)
+        for (i = 0; i < 256; i++)
+            crcslice[k][i] = (crcslice[k - 1][i] >> 8) ^ crctable[crcslice[k - 1][i] & 0xFF];
+
+    for (i = 0; i < CRC16_NENGINES; i++) {
+#ifdef HAVE_CRC16_CLMUL
+        if (crc16_engines[i].block == crc16_clmul && !have_clmul)
+            continue;
+#endif
+        if (crc16_selftest(&crc16_engines[i]) == 0) {
+            crc16_engine = &crc16_engines[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
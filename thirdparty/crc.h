@@ -18,4 +18,18 @@
  * len is the length of the data */
 uint16_t crc16_block(uint16_t crc, uint8_t *data, int len);
 
+/* compute the CRC-16 of count buffers at once.
+ * crc holds the initial CRC value of each buffer on input, and the result
+ * on output */
+void crc16_block_multi(uint8_t * const *data, const int *len, uint16_t *crc, int count);
+
+/* select the fastest implementation supported by the CPU (carry-less
+ * multiply, slice-by-8, slice-by-4 or the byte loop) and check it against
+ * the test vector of the standard.
+ * returns 0 on success, -1 if no implementation passes the self-test */
+int crc16_init(void);
+
+/* name of the implementation selected by crc16_init() */
+const char * crc16_engine_name(void);
+
 #endif /* __802154_CRC */
@@ -21,13 +21,14 @@
 * this software.
 */
 
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<unistd.h>
 #include<getopt.h>
 #include<string.h>
-#include<sys/select.h>
 #include<sys/types.h>
 #include<sys/socket.h>
+#include<netinet/in.h>
 
 #ifndef __USE_POSIX
 #define __USE_POSIX
@@ -42,6 +43,27 @@
 #include<fcntl.h>
 #include<stdlib.h>
 #include<string.h>
+#include<errno.h>
+#include<stdint.h>
+#include<pthread.h>
+#include<sched.h>
+#include<signal.h>
+#include<limits.h>
+#include<time.h>
+#include<math.h>
+#include<poll.h>
+#include<sys/timerfd.h>
+#include<arpa/inet.h>
+#include<sys/epoll.h>
+#include<sys/un.h>
+#include<sys/mman.h>
+#include<sys/eventfd.h>
+#include<sys/signalfd.h>
+#include<stddef.h>
+
+#include "encap.h"
+#include "shmring.h"
+#include "mac802154.h"
 
 #ifdef DEBUG
 #define PRINTF(...) printf(__VA_ARGS__)
@@ -50,240 +72,3337 @@
 #endif
 
 #define BUFSIZE 2048
+#define FANOUT_BATCH 128 /* destinations per sendmmsg() call */
+#define MAX_WORKERS 256
+#define WORKER_EVENTS 64 /* events handled per epoll_wait() call */
+#define NCHANNELS 27 /* IEEE 802.15.4 channels 0 to 26 */
+#define DEFAULT_CHANNEL 11
+#define CHANNEL_NOTIFICATION 'C' /* control message (see encap.h) from a client, with its channel */
+#define UNIX_PREFIX "unix:"
 
 #define HAVE_GETOPT_LONG
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option iz_long_opts[] = {
 	{ "local-port", required_argument, NULL, 'l' },
+	{ "listen", required_argument, NULL, 'u' },
     { "write", required_argument, NULL, 'w' },
+	{ "file-size", required_argument, NULL, 'C' },
+	{ "rotate-seconds", required_argument, NULL, 'G' },
+	{ "pcapng", no_argument, NULL, 'P' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "affinity", required_argument, NULL, 'a' },
+	{ "topology", required_argument, NULL, 't' },
+	{ "positions", required_argument, NULL, 'p' },
+	{ "benchmark", required_argument, NULL, 'b' },
+	{ "transport-benchmark", required_argument, NULL, 'T' },
+	{ "collisions", no_argument, NULL, 'c' },
+	{ "promiscuous", no_argument, NULL, 'm' },
+	{ "virtual-time", required_argument, NULL, 'V' },
 	{ "version", no_argument, NULL, 'v' },
 	{ "help", no_argument, NULL, 'h' },
 	{ NULL, 0, NULL, 0 },
 };
 #endif
 
-struct client_list {
-	struct sockaddr addr;
+/* clients are identified by their address family, address, port and
+ * device (several devices may share a socket, see encap.h).
+ * IPv4-mapped IPv6 addresses are folded into their IPv4 form, so that a
+ * client is found whichever socket family it reached the broker through.
+ * The path of a unix socket is kept whole, its length standing for the port */
+struct client_key {
+	uint16_t family;
+	uint16_t port;
+	uint16_t device;
+	uint16_t reserved;
+	uint32_t scope_id;
+	uint8_t addr[16];
+	char path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+};
+
+/* an IEEE 802.15.4 address a client sends from. Short addresses only make
+ * sense within their PAN, extended addresses are unique (their PAN is left
+ * to 0) */
+struct mac_key {
+	uint64_t addr;
+	uint16_t pan;
+	uint8_t mode; /* MAC_ADDR_SHORT or MAC_ADDR_LONG */
+};
+
+struct mac_entry {
+	struct mac_key key;
+	int client; /* index + 1 of the client, 0 for an empty entry */
+	/* last time the client sent from the address (monotonic clock, in
+	 * nanoseconds), updated in place in the current snapshot */
+	uint64_t last_seen;
+};
+
+/* client registry: the clients live in contiguous arrays, in their order
+ * of arrival, so that the fan-out walks memory linearly. An open addressing
+ * hash table (linear probing) maps a key to its index in the arrays. The
+ * devices of a client that leaves are removed by rebuilding the snapshot
+ * (see registry_without_peer()) */
+struct client_registry {
+	struct sockaddr_storage * addr;
+	socklen_t * addrlen;
+	struct client_key * keys;
+	int nclients;
+	int capacity;
+	int * slots; /* index + 1 of the client, 0 for an empty slot */
+	unsigned nslots; /* always a power of two */
+	/* with a topology: node of each client and client of each node,
+	 * -1 when there is none */
+	int * node;
+	int * node_client;
+	/* with the collision engine, state of the radio of each client. The
+	 * radios are shared by every snapshot */
+	struct radio ** radio;
+	/* channel of each client, and the clients of each channel: the members
+	 * of channel c are members[channel_first[c]] to
+	 * members[channel_first[c + 1] - 1], in their order of arrival */
+	uint8_t * channel;
+	/* version of the header the client uses, 0 for bare frames */
+	uint8_t * version;
+	/* identifier of the client in the header of the frames it sends (see
+	 * encap.h), which does not change when other clients leave */
+	uint32_t * link;
+	uint32_t next_link;
+	/* clients attached through shared memory, NULL for socket clients.
+	 * The peers are shared by every snapshot */
+	struct shm_peer ** shm;
+	/* addresses learned from the source of the frames, so that a unicast
+	 * frame is only relayed to its destination: open addressing hash
+	 * table, as for the clients (an address moves to the last client that
+	 * sent from it) */
+	struct mac_entry * macs;
+	unsigned nmacs;
+	unsigned nmac_slots; /* a power of two, 0 until an address is learned */
+	int * members;
+	int channel_first[NCHANNELS + 1];
+	uint64_t retire_epoch; /* epoch at which the snapshot was replaced */
+	struct client_registry * next_retired;
+	/* peer whose devices the next snapshot removed, released along with
+	 * this snapshot */
+	struct shm_peer * detached;
+};
+
+#define REGISTRY_INITIAL_SLOTS 64
+/* time a client must stop sending from an address before it moves to another
+ * client (see mac_entry_idle()) */
+#define MAC_MOVE_IDLE_NS 1000000000ull
+
+/* build the lookup key of a socket address */
+void client_key_init(struct client_key * key, const struct sockaddr_storage * addr, socklen_t addrlen) {
+	const struct sockaddr_in * sin = (const struct sockaddr_in *) addr;
+	const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *) addr;
+	const struct sockaddr_un * sun = (const struct sockaddr_un *) addr;
+
+	memset(key, 0, sizeof(*key));
+	key->family = addr->ss_family;
+
+	switch (addr->ss_family) {
+	case AF_INET:
+		key->port = sin->sin_port;
+		memcpy(key->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+		break;
+	case AF_INET6:
+		key->port = sin6->sin6_port;
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			key->family = AF_INET;
+			memcpy(key->addr, &sin6->sin6_addr.s6_addr[12], 4);
+		} else {
+			key->scope_id = sin6->sin6_scope_id;
+			memcpy(key->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+		}
+		break;
+	case AF_UNIX:
+		/* abstract names start with a 0 and are not terminated */
+		if (addrlen > offsetof(struct sockaddr_un, sun_path)) {
+			key->port = addrlen - offsetof(struct sockaddr_un, sun_path);
+			if (key->port > sizeof(key->path))
+				key->port = sizeof(key->path);
+			memcpy(key->path, sun->sun_path, key->port);
+		}
+		break;
+	}
+}
+
+/* do two clients share a socket */
+int client_key_same_socket(const struct client_key * a, const struct client_key * b) {
+	return a->family == b->family && a->port == b->port && a->scope_id == b->scope_id &&
+		memcmp(a->addr, b->addr, sizeof(a->addr)) == 0 &&
+		(a->family != AF_UNIX || memcmp(a->path, b->path, a->port) == 0);
+}
+
+/* FNV-1a over the (zero padded) key, up to the end of the path of a unix
+ * socket */
+unsigned client_key_hash(const struct client_key * key) {
+	const uint8_t * p = (const uint8_t *) key;
+	size_t i, len = offsetof(struct client_key, path) + (key->family == AF_UNIX ? key->port : 0);
+	uint32_t h = 2166136261u;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+void * registry_alloc(void * ptr, size_t size) {
+	ptr = realloc(ptr, size);
+
+	if (!ptr) {
+		perror("realloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+uint64_t bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* is the source of a frame an address that only one device uses: not the
+ * broadcast or "no short address" addresses, nor a short address outside
+ * of a PAN, nor an extended address that was not set */
+int mac_learnable(const struct mac_header * h) {
+	if (h->src_mode == MAC_ADDR_SHORT)
+		return h->src < 0xfffe && h->src_pan != MAC_BROADCAST;
+	if (h->src_mode == MAC_ADDR_LONG)
+		return h->src != 0 && h->src != UINT64_MAX;
+	return 0;
+}
+
+/* an address only moves to another client once the client that sends from
+ * it has been silent for MAC_MOVE_IDLE_NS: two clients that share an address
+ * (e.g. both kept the default one) do not take it from each other with
+ * every frame */
+int mac_entry_idle(const struct mac_entry * e, uint64_t now) {
+	return __atomic_load_n(&e->last_seen, __ATOMIC_RELAXED) + MAC_MOVE_IDLE_NS <= now;
+}
+
+void mac_key_init(struct mac_key * key, uint8_t mode, uint16_t pan, uint64_t addr) {
+	memset(key, 0, sizeof(*key));
+	key->mode = mode;
+	key->addr = addr;
+	if (mode == MAC_ADDR_SHORT)
+		key->pan = pan;
+}
+
+/* FNV-1a over the (zero padded) key */
+unsigned mac_key_hash(const struct mac_key * key) {
+	const uint8_t * p = (const uint8_t *) key;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(*key); i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* find the client that sends from an address, or return -1 */
+struct mac_entry * registry_find_mac_entry(const struct client_registry * r, const struct mac_key * key) {
+	unsigned i;
+
+	if (!r->nmac_slots)
+		return NULL;
+
+	for (i = mac_key_hash(key) & (r->nmac_slots - 1); r->macs[i].client; i = (i + 1) & (r->nmac_slots - 1))
+		if (memcmp(&r->macs[i].key, key, sizeof(*key)) == 0)
+			return &r->macs[i];
+
+	return NULL;
+}
+
+int registry_find_mac(const struct client_registry * r, const struct mac_key * key) {
+	const struct mac_entry * e = registry_find_mac_entry(r, key);
+
+	return e ? e->client - 1 : -1;
+}
+
+/* insert or move an address, the table must not be full */
+void registry_insert_mac(struct client_registry * r, const struct mac_key * key, int client, uint64_t last_seen) {
+	unsigned i;
+
+	for (i = mac_key_hash(key) & (r->nmac_slots - 1); r->macs[i].client; i = (i + 1) & (r->nmac_slots - 1))
+		if (memcmp(&r->macs[i].key, key, sizeof(*key)) == 0)
+			break;
+
+	if (!r->macs[i].client)
+		r->nmacs++;
+	r->macs[i].key = *key;
+	r->macs[i].client = client + 1;
+	r->macs[i].last_seen = last_seen;
+}
+
+/* map an address to a client, growing the table to keep its load factor
+ * under one half */
+void registry_add_mac(struct client_registry * r, const struct mac_key * key, int client, uint64_t last_seen) {
+	struct mac_entry * old = r->macs;
+	unsigned i, nold = r->nmac_slots;
+
+	if ((r->nmacs + 1) * 2 > r->nmac_slots) {
+		r->nmac_slots = r->nmac_slots ? r->nmac_slots * 2 : REGISTRY_INITIAL_SLOTS;
+		r->macs = (struct mac_entry *) calloc(r->nmac_slots, sizeof(*r->macs));
+		if (!r->macs) {
+			perror("calloc()");
+			exit(EXIT_FAILURE);
+		}
+		r->nmacs = 0;
+		for (i = 0; i < nold; i++)
+			if (old[i].client)
+				registry_insert_mac(r, &old[i].key, old[i].client - 1, old[i].last_seen);
+		free(old);
+	}
+
+	registry_insert_mac(r, key, client, last_seen);
+}
+
+/* insert the index of a client in the hash table, which must not be full */
+void registry_insert_slot(struct client_registry * r, int idx) {
+	unsigned i = client_key_hash(&r->keys[idx]) & (r->nslots - 1);
+
+	while (r->slots[i])
+		i = (i + 1) & (r->nslots - 1);
+
+	r->slots[i] = idx + 1;
+}
+
+/* double the size of the hash table and rehash every client */
+void registry_grow_slots(struct client_registry * r) {
+	int i;
+
+	r->nslots = r->nslots ? r->nslots * 2 : REGISTRY_INITIAL_SLOTS;
+	free(r->slots);
+	r->slots = (int *) calloc(r->nslots, sizeof(int));
+
+	if (!r->slots) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < r->nclients; i++)
+		registry_insert_slot(r, i);
+}
+
+/* find a client or return -1 if none is found */
+int registry_find(const struct client_registry * r, const struct client_key * key) {
+	unsigned i;
+	int idx;
+
+	if (!r->nslots)
+		return -1;
+
+	for (i = client_key_hash(key) & (r->nslots - 1); (idx = r->slots[i]); i = (i + 1) & (r->nslots - 1))
+		if (memcmp(&r->keys[idx - 1], key, sizeof(*key)) == 0)
+			return idx - 1;
+
+	return -1;
+}
+
+/* register a new client and return its index */
+int registry_add(struct client_registry * r, const struct client_key * key,
+				 const struct sockaddr_storage * addr, socklen_t addrlen) {
+	int idx;
+
+	if (r->nclients == r->capacity) {
+		r->capacity = r->capacity ? r->capacity * 2 : REGISTRY_INITIAL_SLOTS / 2;
+		r->addr = registry_alloc(r->addr, r->capacity * sizeof(*r->addr));
+		r->addrlen = registry_alloc(r->addrlen, r->capacity * sizeof(*r->addrlen));
+		r->keys = registry_alloc(r->keys, r->capacity * sizeof(*r->keys));
+		r->node = registry_alloc(r->node, r->capacity * sizeof(*r->node));
+		r->radio = registry_alloc(r->radio, r->capacity * sizeof(*r->radio));
+		r->channel = registry_alloc(r->channel, r->capacity * sizeof(*r->channel));
+		r->version = registry_alloc(r->version, r->capacity * sizeof(*r->version));
+		r->link = registry_alloc(r->link, r->capacity * sizeof(*r->link));
+		r->shm = registry_alloc(r->shm, r->capacity * sizeof(*r->shm));
+		r->members = registry_alloc(r->members, r->capacity * sizeof(*r->members));
+	}
+
+	idx = r->nclients++;
+	r->node[idx] = -1;
+	r->radio[idx] = NULL;
+	r->channel[idx] = DEFAULT_CHANNEL;
+	r->version[idx] = 0;
+	r->link[idx] = r->next_link++;
+	r->shm[idx] = NULL;
+	memcpy(&r->addr[idx], addr, addrlen);
+	r->addrlen[idx] = addrlen;
+	r->keys[idx] = *key;
+
+	/* keep the load factor of the hash table under one half */
+	if ((unsigned) r->nclients * 2 > r->nslots)
+		registry_grow_slots(r);
+	else
+		registry_insert_slot(r, idx);
+
+	return idx;
+}
+
+/* free the arrays of a registry, every field included, whether the
+ * registry is a snapshot or is embedded (e.g. the nodes of a model) */
+void registry_clear(struct client_registry * r) {
+	free(r->addr);
+	free(r->addrlen);
+	free(r->keys);
+	free(r->slots);
+	free(r->node);
+	free(r->node_client);
+	free(r->radio);
+	free(r->channel);
+	free(r->version);
+	free(r->link);
+	free(r->shm);
+	free(r->macs);
+	free(r->members);
+	memset(r, 0, sizeof(*r));
+}
+
+void registry_free(struct client_registry * r) {
+	registry_clear(r);
+	free(r);
+}
+
+/* rebuild the member lists of the channels (counting sort, which keeps the
+ * clients of a channel in their order of arrival) */
+void registry_index_channels(struct client_registry * r) {
+	int count[NCHANNELS] = { 0 }, pos[NCHANNELS];
+	int i, c;
+
+	for (i = 0; i < r->nclients; i++)
+		count[r->channel[i]]++;
+
+	r->channel_first[0] = 0;
+	for (c = 0; c < NCHANNELS; c++) {
+		pos[c] = r->channel_first[c];
+		r->channel_first[c + 1] = r->channel_first[c] + count[c];
+	}
+
+	for (i = 0; i < r->nclients; i++)
+		r->members[pos[r->channel[i]]++] = i;
+}
+
+/* a topology restricts the fan-out to the neighbours of the sender, with a
+ * loss probability, a propagation delay and an LQI per (directed) link.
+ * The nodes are kept in a registry of their own, and their links in a
+ * compressed adjacency array: the links of node i are
+ * links[first[i]] to links[first[i + 1] - 1] */
+struct link {
+	int dst; /* destination node */
+	uint32_t delay; /* in timer wheel ticks */
+	uint64_t loss; /* loss probability, scaled by 2^32 */
+	uint8_t lqi;
+};
+
+struct topology {
+	struct client_registry nodes;
+	int * first;
+	struct link * links;
+	int nlinks;
+};
+
+static struct topology * topology;
+
+/* nodes of the propagation model in use (topology or positions), NULL when
+ * every client hears every other */
+static struct client_registry * nodes;
+
+#define WHEEL_TICK_NS 16000 /* one 802.15.4 symbol at 2.4 GHz */
+
+/* parse a node address: ipv4:port or [ipv6]:port, optionally followed by
+ * /device when several devices share the socket */
+int parse_node_address(const char * str, struct sockaddr_storage * addr, socklen_t * addrlen, int * device) {
+	struct addrinfo hints, * res;
+	char host[INET6_ADDRSTRLEN + 2], service[16];
+	const char * port = strrchr(str, ':'), * dev;
+	char * end;
+	size_t len;
+
+	if (!port || (len = port - str) >= sizeof(host))
+		return -1;
+
+	*device = 0;
+	if ( (dev = strchr(port, '/')) ) {
+		*device = strtol(dev + 1, &end, 10);
+		if (end == dev + 1 || *end || *device < 0 || *device > UINT16_MAX)
+			return -1;
+	} else
+		dev = port + strlen(port);
+	if ((size_t) (dev - port) >= sizeof(service))
+		return -1;
+	memcpy(service, port + 1, dev - port - 1);
+	service[dev - port - 1] = '\0';
+
+	if (str[0] == '[' && len >= 2 && str[len - 1] == ']') {
+		str++;
+		len -= 2;
+	}
+	memcpy(host, str, len);
+	host[len] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	if (getaddrinfo(host, service, &hints, &res) != 0)
+		return -1;
+
+	memset(addr, 0, sizeof(*addr));
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	*addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+/* return the index of a node of a propagation model, adding it if needed
+ * (and allowed) or -1 */
+int model_node(struct client_registry * n, const char * str, const char * file, int lineno, int add) {
+	struct sockaddr_storage addr;
+	struct client_key key;
+	socklen_t addrlen;
+	int idx, device;
+
+	if (parse_node_address(str, &addr, &addrlen, &device) < 0) {
+		fprintf(stderr, "%s:%d: invalid node address %s (expected ipv4:port or [ipv6]:port, "
+				"optionally followed by /device)\n", file, lineno, str);
+		exit(EXIT_FAILURE);
+	}
+
+	client_key_init(&key, &addr, addrlen);
+	key.device = device;
+	if ((idx = registry_find(n, &key)) < 0 && add)
+		idx = registry_add(n, &key, &addr, addrlen);
+
+	return idx;
+}
+
+/* load a topology file. Each line describes a directed link:
+ * src dst loss delay_us lqi
+ * where loss is a probability between 0 and 1. Empty lines and lines
+ * starting with # are ignored */
+struct topology * topology_load(const char * file) {
+	struct topology * t;
+	struct link * links = NULL;
+	int * src = NULL;
+	int i, nlinks = 0, capacity = 0, lineno = 0;
+	char line[512], s[128], d[128];
+	double loss;
+	unsigned long delay_us;
+	unsigned lqi;
+	FILE * f;
+
+	if (!(f = fopen(file, "r"))) {
+		perror("fopen()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(t = (struct topology *) calloc(1, sizeof(*t)))) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char * p = line + strspn(line, " \t");
+
+		lineno++;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (sscanf(p, "%127s %127s %lf %lu %u", s, d, &loss, &delay_us, &lqi) != 5 ||
+			loss < 0 || loss > 1 || lqi > 255) {
+			fprintf(stderr, "%s:%d: expected \"src dst loss delay_us lqi\"\n", file, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		if (nlinks == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			links = registry_alloc(links, capacity * sizeof(*links));
+			src = registry_alloc(src, capacity * sizeof(*src));
+		}
+
+		src[nlinks] = model_node(&t->nodes, s, file, lineno, 1);
+		links[nlinks].dst = model_node(&t->nodes, d, file, lineno, 1);
+		links[nlinks].loss = (uint64_t) (loss * 4294967296.0);
+		links[nlinks].delay = (delay_us * 1000 + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+		links[nlinks].lqi = lqi;
+		nlinks++;
+	}
+	fclose(f);
+
+	/* counting sort of the links by source node */
+	t->first = (int *) calloc(t->nodes.nclients + 1, sizeof(int));
+	t->links = registry_alloc(NULL, (nlinks ? nlinks : 1) * sizeof(*t->links));
+	if (!t->first) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nlinks; i++)
+		t->first[src[i]]++;
+	for (i = 1; i < t->nodes.nclients; i++)
+		t->first[i] += t->first[i - 1];
+	for (i = nlinks - 1; i >= 0; i--)
+		t->links[--t->first[src[i]]] = links[i];
+	t->first[t->nodes.nclients] = nlinks;
+	t->nlinks = nlinks;
+
+	free(links);
+	free(src);
+
+	PRINTF("topology %s: %d nodes, %d links\n", file, t->nodes.nclients, nlinks);
+	return t;
+}
+
+/* a position model delivers a packet to the clients within the radio range
+ * of its sender. The nodes are indexed by a uniform grid, whose cells are as
+ * large as the longest range: the neighbours of a node are found in the 27
+ * cells around it. The grid is hashed, so that it does not need bounds, and
+ * each bucket is a doubly linked list of nodes, so that a node moves from a
+ * cell to another in O(1) when the positions are updated */
+struct spatial {
+	struct client_registry nodes;
+	double * x, * y, * z, * range;
+	int * cx, * cy, * cz; /* cell of each node */
+	int * next, * prev; /* bucket lists, -1 terminated */
+	int * buckets;
+	unsigned nbuckets; /* a power of two */
+	double cell_size;
+	pthread_rwlock_t lock; /* held for writing while nodes move */
+	const char * file;
+};
+
+static struct spatial * spatial;
+
+unsigned spatial_hash(const struct spatial * sp, int cx, int cy, int cz) {
+	uint32_t h = (uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u ^ (uint32_t) cz * 83492791u;
+	return h & (sp->nbuckets - 1);
+}
+
+void spatial_unlink(struct spatial * sp, int n) {
+	if (sp->prev[n] >= 0)
+		sp->next[sp->prev[n]] = sp->next[n];
+	else
+		sp->buckets[spatial_hash(sp, sp->cx[n], sp->cy[n], sp->cz[n])] = sp->next[n];
+	if (sp->next[n] >= 0)
+		sp->prev[sp->next[n]] = sp->prev[n];
+}
+
+void spatial_link(struct spatial * sp, int n) {
+	unsigned b;
+
+	sp->cx[n] = (int) floor(sp->x[n] / sp->cell_size);
+	sp->cy[n] = (int) floor(sp->y[n] / sp->cell_size);
+	sp->cz[n] = (int) floor(sp->z[n] / sp->cell_size);
+	b = spatial_hash(sp, sp->cx[n], sp->cy[n], sp->cz[n]);
+
+	sp->prev[n] = -1;
+	sp->next[n] = sp->buckets[b];
+	if (sp->buckets[b] >= 0)
+		sp->prev[sp->buckets[b]] = n;
+	sp->buckets[b] = n;
+}
+
+/* (re)build the grid from scratch, when the longest range changes */
+void spatial_build(struct spatial * sp) {
+	unsigned i;
+	int n;
+
+	sp->cell_size = 0;
+	for (n = 0; n < sp->nodes.nclients; n++)
+		if (sp->range[n] > sp->cell_size)
+			sp->cell_size = sp->range[n];
+	if (sp->cell_size <= 0)
+		sp->cell_size = 1;
+
+	for (i = 0; i < sp->nbuckets; i++)
+		sp->buckets[i] = -1;
+	for (n = 0; n < sp->nodes.nclients; n++)
+		spatial_link(sp, n);
+}
+
+/* move a node. The caller holds the lock for writing */
+void spatial_move(struct spatial * sp, int n, double x, double y, double z) {
+	sp->x[n] = x;
+	sp->y[n] = y;
+	sp->z[n] = z;
+
+	if ((int) floor(x / sp->cell_size) == sp->cx[n] &&
+		(int) floor(y / sp->cell_size) == sp->cy[n] &&
+		(int) floor(z / sp->cell_size) == sp->cz[n])
+		return;
+
+	spatial_unlink(sp, n);
+	spatial_link(sp, n);
+}
+
+/* list the nodes within the range of node n (n excluded), returns their
+ * number. out must hold as many entries as there are nodes */
+int spatial_neighbours(const struct spatial * sp, int n, int * out) {
+	double r2 = sp->range[n] * sp->range[n], dx, dy, dz;
+	int cx, cy, cz, m, count = 0;
+
+	for (cx = sp->cx[n] - 1; cx <= sp->cx[n] + 1; cx++)
+		for (cy = sp->cy[n] - 1; cy <= sp->cy[n] + 1; cy++)
+			for (cz = sp->cz[n] - 1; cz <= sp->cz[n] + 1; cz++)
+				for (m = sp->buckets[spatial_hash(sp, cx, cy, cz)]; m >= 0; m = sp->next[m]) {
+					/* several cells may share a bucket */
+					if (m == n || sp->cx[m] != cx || sp->cy[m] != cy || sp->cz[m] != cz)
+						continue;
+					dx = sp->x[m] - sp->x[n];
+					dy = sp->y[m] - sp->y[n];
+					dz = sp->z[m] - sp->z[n];
+					if (dx * dx + dy * dy + dz * dz <= r2)
+						out[count++] = m;
+				}
+
+	return count;
+}
+
+/* read a positions file: one node per line, "node x y z range".
+ * Empty lines and lines starting with # are ignored.
+ * With add unset, only the nodes already known are updated */
+void spatial_read(struct spatial * sp, const char * file, int add) {
+	char line[512], node[128];
+	double x, y, z, range;
+	int n, lineno = 0, rebuild = 0, capacity = 0;
+	FILE * f;
+
+	if (!(f = fopen(file, "r"))) {
+		perror("fopen()");
+		if (add)
+			exit(EXIT_FAILURE);
+		return;
+	}
+
+	if (!add)
+		pthread_rwlock_wrlock(&sp->lock);
+
+	while (fgets(line, sizeof(line), f)) {
+		char * p = line + strspn(line, " \t");
+
+		lineno++;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (sscanf(p, "%127s %lf %lf %lf %lf", node, &x, &y, &z, &range) != 5 || range < 0) {
+			fprintf(stderr, "%s:%d: expected \"node x y z range\"\n", file, lineno);
+			if (add)
+				exit(EXIT_FAILURE);
+			continue;
+		}
+
+		if ( (n = model_node(&sp->nodes, node, file, lineno, add)) < 0 ) {
+			fprintf(stderr, "%s:%d: unknown node %s, ignored (new nodes need a restart)\n",
+					file, lineno, node);
+			continue;
+		}
+
+		if (add && sp->nodes.nclients > capacity) {
+			capacity = sp->nodes.capacity;
+			sp->x = registry_alloc(sp->x, capacity * sizeof(double));
+			sp->y = registry_alloc(sp->y, capacity * sizeof(double));
+			sp->z = registry_alloc(sp->z, capacity * sizeof(double));
+			sp->range = registry_alloc(sp->range, capacity * sizeof(double));
+		}
+
+		if (add) {
+			sp->x[n] = x;
+			sp->y[n] = y;
+			sp->z[n] = z;
+		} else if (range <= sp->cell_size)
+			spatial_move(sp, n, x, y, z);
+		else {
+			sp->x[n] = x;
+			sp->y[n] = y;
+			sp->z[n] = z;
+			rebuild = 1;
+		}
+		sp->range[n] = range;
+	}
+	fclose(f);
+
+	if (rebuild)
+		spatial_build(sp);
+
+	if (!add)
+		pthread_rwlock_unlock(&sp->lock);
+}
+
+/* allocate the grid once the nodes are known, and fill it */
+void spatial_index(struct spatial * sp) {
+	int n = sp->nodes.nclients ? sp->nodes.nclients : 1;
+
+	sp->cx = registry_alloc(NULL, n * sizeof(int));
+	sp->cy = registry_alloc(NULL, n * sizeof(int));
+	sp->cz = registry_alloc(NULL, n * sizeof(int));
+	sp->next = registry_alloc(NULL, n * sizeof(int));
+	sp->prev = registry_alloc(NULL, n * sizeof(int));
+	for (sp->nbuckets = 64; sp->nbuckets < 2 * (unsigned) n; sp->nbuckets *= 2)
+		;
+	sp->buckets = registry_alloc(NULL, sp->nbuckets * sizeof(int));
+	spatial_build(sp);
+}
+
+struct spatial * spatial_load(const char * file) {
+	struct spatial * sp;
+
+	if (!(sp = (struct spatial *) calloc(1, sizeof(*sp)))) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	pthread_rwlock_init(&sp->lock, NULL);
+	sp->file = file;
+
+	spatial_read(sp, file, 1);
+	spatial_index(sp);
+
+	PRINTF("positions %s: %d nodes, cell size %g\n", file, sp->nodes.nclients, sp->cell_size);
+	return sp;
+}
+
+/* SIGHUP is blocked in every thread and received here: the positions file
+ * is read again and the nodes are moved accordingly */
+void * spatial_reloader(void * arg) {
+	sigset_t set;
+	int sig;
+
+	(void) arg;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+
+	while (1) {
+		if (sigwait(&set, &sig) != 0)
+			continue;
+		PRINTF("reloading the positions from %s\n", spatial->file);
+		spatial_read(spatial, spatial->file, 0);
+	}
+
+	return NULL;
+}
+
+/* compare the cost of finding the receivers of a frame with the grid and
+ * with a scan of every node, for nnodes nodes spread on a plane at various
+ * densities (expressed as the average number of neighbours) */
+void spatial_benchmark(int nnodes) {
+	static const int density[] = { 5, 10, 20, 50, 100, 200 };
+	const int queries = 10000;
+	struct sockaddr_storage addr;
+	struct client_key key;
+	struct spatial * sp;
+	unsigned long found, scanned;
+	uint64_t start, grid_ns, scan_ns;
+	double side, dx, dy;
+	int * out;
+	int d, i, q, n, m;
+
+	printf("spatial index benchmark: %d nodes, range 1, %d frames per density\n", nnodes, queries);
+	printf("%12s %12s %16s %16s\n", "neighbours", "found", "grid (ns/frame)", "scan (ns/frame)");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ss_family = AF_INET;
+	out = registry_alloc(NULL, nnodes * sizeof(int));
+	srand(1);
+
+	for (d = 0; d < (int) (sizeof(density) / sizeof(density[0])); d++) {
+		if (!(sp = (struct spatial *) calloc(1, sizeof(*sp)))) {
+			perror("calloc()");
+			exit(EXIT_FAILURE);
+		}
+
+		sp->x = registry_alloc(NULL, nnodes * sizeof(double));
+		sp->y = registry_alloc(NULL, nnodes * sizeof(double));
+		sp->z = registry_alloc(NULL, nnodes * sizeof(double));
+		sp->range = registry_alloc(NULL, nnodes * sizeof(double));
+
+		/* density[d] = nnodes * pi * range^2 / side^2 */
+		side = sqrt(nnodes * M_PI / density[d]);
+		for (n = 0; n < nnodes; n++) {
+			memset(&key, 0, sizeof(key));
+			key.family = AF_INET;
+			key.port = n;
+			memcpy(key.addr, &n, sizeof(n));
+			registry_add(&sp->nodes, &key, &addr, sizeof(struct sockaddr_in));
+			sp->x[n] = side * rand() / RAND_MAX;
+			sp->y[n] = side * rand() / RAND_MAX;
+			sp->z[n] = 0;
+			sp->range[n] = 1;
+		}
+		spatial_index(sp);
+
+		found = 0;
+		start = bench_now();
+		for (q = 0; q < queries; q++)
+			found += spatial_neighbours(sp, q % nnodes, out);
+		grid_ns = bench_now() - start;
+
+		scanned = 0;
+		start = bench_now();
+		for (q = 0; q < queries; q++) {
+			n = q % nnodes;
+			for (i = 0, m = 0; m < nnodes; m++) {
+				dx = sp->x[m] - sp->x[n];
+				dy = sp->y[m] - sp->y[n];
+				if (m != n && dx * dx + dy * dy <= 1)
+					out[i++] = m;
+			}
+			scanned += i;
+		}
+		scan_ns = bench_now() - start;
+
+		if (scanned != found)
+			fprintf(stderr, "the grid found %lu neighbours, the scan %lu\n", found, scanned);
+
+		printf("%12d %12.1f %16.0f %16.0f\n", density[d], (double) found / queries,
+			   (double) grid_ns / queries, (double) scan_ns / queries);
+
+		free(sp->x);
+		free(sp->y);
+		free(sp->z);
+		free(sp->range);
+		free(sp->cx);
+		free(sp->cy);
+		free(sp->cz);
+		free(sp->next);
+		free(sp->prev);
+		free(sp->buckets);
+		registry_clear(&sp->nodes);
+		free(sp);
+	}
+
+	free(out);
+}
+
+/* collision engine: a frame occupies the channel for its airtime (the
+ * preamble, SFD and PHR, then the frame itself, at 250 kb/s), at the
+ * sender and at each of its receivers. Every frame that overlaps another
+ * one at a radio is lost. Frames are delivered at the end of their
+ * airtime, once all the frames that could overlap them are known, and the
+ * receivers are told as the frame starts that their channel is busy, so
+ * that they can answer CCA and ED requests.
+ * With link delays, a radio does not hear the frames in the order they
+ * were sent, and has its own lock, so that the workers only contend for
+ * the same receiver. Each radio keeps two sets of disjoint intervals, in
+ * treaps ordered by start (and so by end):
+ * - the periods during which its channel was busy, the union of the
+ *   frames it heard: a new frame collides if it overlaps one of them;
+ * - the frames waiting for their delivery that did not collide (yet),
+ *   which are disjoint as two overlapping frames both collide.
+ * A frame thus costs O(log n), plus the intervals it merges or marks,
+ * each of which is only merged or marked once */
+#define PHY_HEADER_LEN 6 /* preamble (4), SFD (1) and PHR (1) */
+#define PHY_BYTE_US 32 /* 2.4 GHz O-QPSK, 250 kb/s */
+#define BUSY_NOTIFICATION 'B' /* followed by the airtime in us, big endian */
+/* a busy period that ended is forgotten after this many ticks (1 ms), which
+ * covers a worker that read the clock a little earlier than another one */
+#define RADIO_MARGIN_TICKS (1000000 / WHEEL_TICK_NS)
+
+/* a busy period, or a frame waiting for its delivery */
+struct airtime {
+	uint64_t start; /* tick */
+	uint64_t end;
+	struct airtime * left, * right;
+	uint32_t priority;
+	uint8_t collided; /* frames only */
+};
+
+struct radio {
+	pthread_mutex_t lock;
+	int refs; /* the registry, and the delayed frames to the radio */
+	uint32_t seed; /* of the treap priorities */
+	struct airtime * busy;
+	struct airtime * clean;
+	struct airtime * free;
+};
+
+static int collisions = 0;
+static int promiscuous = 0;
+
+struct radio * radio_new(void) {
+	struct radio * rd = (struct radio *) calloc(1, sizeof(*rd));
+
+	if (!rd) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&rd->lock, NULL);
+	rd->refs = 1;
+	rd->seed = 2463534242u;
+	return rd;
+}
+
+/* the delayed frames keep the radio of their receiver, whose device may
+ * leave before they are delivered */
+struct radio * radio_hold(struct radio * rd) {
+	if (rd)
+		__atomic_add_fetch(&rd->refs, 1, __ATOMIC_RELAXED);
+	return rd;
+}
+
+/* free an interval and all those below it */
+void airtime_free_tree(struct airtime * t) {
+	struct airtime * next;
+
+	for (; t; t = next) {
+		airtime_free_tree(t->left);
+		next = t->right;
+		free(t);
+	}
+}
+
+void radio_put(struct radio * rd) {
+	if (rd && __atomic_sub_fetch(&rd->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		/* no frame is waiting for its delivery any more */
+		airtime_free_tree(rd->busy);
+		airtime_free_tree(rd->free);
+		pthread_mutex_destroy(&rd->lock);
+		free(rd);
+	}
+}
+
+/* the intervals are recycled per radio (chained by right), and allocated
+ * with the lock of the radio held */
+struct airtime * airtime_alloc(struct radio * rd, uint64_t start, uint64_t end) {
+	struct airtime * a = rd->free;
+
+	if (a)
+		rd->free = a->right;
+	else if ( !(a = (struct airtime *) malloc(sizeof(*a))) ) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	/* xorshift32 */
+	rd->seed ^= rd->seed << 13;
+	rd->seed ^= rd->seed >> 17;
+	rd->seed ^= rd->seed << 5;
+
+	a->start = start;
+	a->end = end;
+	a->left = a->right = NULL;
+	a->priority = rd->seed;
+	a->collided = 0;
+	return a;
+}
+
+void airtime_release(struct radio * rd, struct airtime * a) {
+	a->left = NULL;
+	a->right = rd->free;
+	rd->free = a;
+}
+
+/* split a treap into the intervals that start before key (l) and the
+ * others (r) */
+void airtime_split(struct airtime * t, uint64_t key, struct airtime ** l, struct airtime ** r) {
+	if (!t)
+		*l = *r = NULL;
+	else if (t->start < key) {
+		airtime_split(t->right, key, &t->right, r);
+		*l = t;
+	} else {
+		airtime_split(t->left, key, l, &t->left);
+		*r = t;
+	}
+}
+
+/* join two treaps, the intervals of l starting before those of r */
+struct airtime * airtime_join(struct airtime * l, struct airtime * r) {
+	if (!l)
+		return r;
+	if (!r)
+		return l;
+	if (l->priority > r->priority) {
+		l->right = airtime_join(l->right, r);
+		return l;
+	}
+	r->left = airtime_join(l, r->left);
+	return r;
+}
+
+/* remove the last interval of a treap when it ends after date, and
+ * return it (NULL otherwise) */
+struct airtime * airtime_take_last(struct airtime ** t, uint64_t date) {
+	while (*t && (*t)->right)
+		t = &(*t)->right;
+
+	if (*t && (*t)->end > date) {
+		struct airtime * last = *t;
+
+		*t = last->left;
+		last->left = NULL;
+		return last;
+	}
+	return NULL;
+}
+
+/* the clean frames of a subtree collided, and leave the treap */
+void airtime_collide(struct airtime * t) {
+	struct airtime * next;
+
+	for (; t; t = next) {
+		airtime_collide(t->left);
+		next = t->right;
+		t->collided = 1;
+		t->left = t->right = NULL;
+	}
+}
+
+/* recycle the busy periods of a subtree, and return the end of the last
+ * one (or end, if it is later) */
+uint64_t airtime_merge(struct radio * rd, struct airtime * t, uint64_t end) {
+	struct airtime * next;
+
+	for (; t; t = next) {
+		end = airtime_merge(rd, t->left, end);
+		if (t->end > end)
+			end = t->end;
+		next = t->right;
+		airtime_release(rd, t);
+	}
+	return end;
+}
+
+/* forget the busy periods that can no longer overlap a new frame. Called
+ * with the lock of the radio held */
+void radio_prune(struct radio * rd, uint64_t now) {
+	struct airtime ** t, * first;
+
+	while (rd->busy) {
+		for (t = &rd->busy; (*t)->left; t = &(*t)->left)
+			;
+		if ((*t)->end + RADIO_MARGIN_TICKS >= now)
+			break;
+		first = *t;
+		*t = first->right;
+		airtime_release(rd, first);
+	}
+}
+
+/* account for a frame sent at date now, on the air at a radio from start to
+ * end (ticks). When pending is set, returns the frame, whose delivery must
+ * call airtime_collided(). Returns NULL otherwise */
+struct airtime * airtime_start(struct radio * rd, uint64_t now, uint64_t start, uint64_t end, int pending) {
+	struct airtime * l, * m, * r, * a, * frame = NULL;
+	int collided;
+
+	pthread_mutex_lock(&rd->lock);
+	radio_prune(rd, now);
+
+	/* the busy periods that overlap the frame merge with it: the last one
+	 * that starts before the frame, and those that start during it */
+	airtime_split(rd->busy, start, &l, &r);
+	airtime_split(r, end, &m, &r);
+	a = airtime_take_last(&l, start);
+	collided = a || m;
+	if (a) {
+		a->end = a->end > end ? a->end : end;
+		a->left = a->right = NULL;
+	} else
+		a = airtime_alloc(rd, start, end);
+	a->end = airtime_merge(rd, m, a->end);
+	rd->busy = airtime_join(airtime_join(l, a), r);
+
+	/* the clean frames it overlaps collided */
+	if (collided) {
+		airtime_split(rd->clean, start, &l, &r);
+		airtime_split(r, end, &m, &r);
+		if ( (a = airtime_take_last(&l, start)) )
+			a->collided = 1;
+		airtime_collide(m);
+		rd->clean = airtime_join(l, r);
+	}
+
+	if (pending) {
+		frame = airtime_alloc(rd, start, end);
+		frame->collided = collided;
+		if (!collided) {
+			airtime_split(rd->clean, start, &l, &r);
+			rd->clean = airtime_join(airtime_join(l, frame), r);
+		}
+	}
+	pthread_mutex_unlock(&rd->lock);
+
+	return frame;
+}
+
+/* did a frame collide with another one. The radio then forgets about it */
+int airtime_collided(struct radio * rd, struct airtime * frame) {
+	struct airtime * l, * m, * r;
+	int collided;
+
+	pthread_mutex_lock(&rd->lock);
+	collided = frame->collided;
+	if (!collided) {
+		/* the only clean frame that starts at the same date */
+		airtime_split(rd->clean, frame->start, &l, &r);
+		airtime_split(r, frame->start + 1, &m, &r);
+		rd->clean = airtime_join(l, r);
+	}
+	airtime_release(rd, frame);
+	pthread_mutex_unlock(&rd->lock);
+
+	return collided;
+}
+
+/* shared memory transport (see shmring.h): every client process attached
+ * this way has its own rings, and is handled by one of the workers. The
+ * workers all write to the ring towards the client, under its lock */
+struct shm_peer {
+	int efd_in; /* signaled by the client */
+	int efd_out; /* signaled by the broker */
+	int conn; /* unix socket, closed by the client when it leaves */
+	struct shm_area * area;
+	struct client_key key;
+	pthread_mutex_t lock;
+	int worker;
+	int dead;
+	/* the registry, the listener until the client leaves, and the delayed
+	 * frames to the client */
+	int refs;
+	uint64_t drops;
+};
+
+struct shm_peer * shm_peer_hold(struct shm_peer * peer) {
+	if (peer)
+		__atomic_add_fetch(&peer->refs, 1, __ATOMIC_RELAXED);
+	return peer;
+}
+
+/* drop a reference to a peer, the last one closes its eventfds and unmaps
+ * its rings */
+void shm_peer_put(struct shm_peer * peer) {
+	if (peer && __atomic_sub_fetch(&peer->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(peer->efd_in);
+		close(peer->efd_out);
+		munmap(peer->area, sizeof(struct shm_area));
+		pthread_mutex_destroy(&peer->lock);
+		free(peer);
+	}
+}
+
+/* the registry is shared by the workers and read for every packet, while
+ * new clients are rare: it is published as an immutable snapshot.
+ * Registering a client builds a new snapshot and swaps the pointer; the old
+ * one is freed once every worker went through a quiescent state (the
+ * workers are quiescent while they wait for a packet) */
+static struct client_registry * registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client_registry * retired_registries;
+static uint64_t registry_epoch = 1;
+
+/* per worker epoch: 0 while quiescent, otherwise the global epoch seen
+ * when the worker started to read the registry */
+static uint64_t worker_epoch[MAX_WORKERS];
+static int nworkers = 1;
+
+void registry_enter(int worker) {
+	__atomic_store_n(&worker_epoch[worker], __atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void registry_leave(int worker) {
+	__atomic_store_n(&worker_epoch[worker], 0, __ATOMIC_SEQ_CST);
+}
+
+struct client_registry * registry_get(void) {
+	return __atomic_load_n(&registry, __ATOMIC_SEQ_CST);
+}
+
+/* deep copy of a snapshot */
+struct client_registry * registry_copy(const struct client_registry * r) {
+	struct client_registry * copy;
+
+	copy = (struct client_registry *) calloc(1, sizeof(*copy));
+	if (!copy) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	copy->nclients = r->nclients;
+	copy->capacity = r->capacity;
+	copy->nslots = r->nslots;
+	if (r->capacity) {
+		copy->addr = registry_alloc(NULL, r->capacity * sizeof(*r->addr));
+		copy->addrlen = registry_alloc(NULL, r->capacity * sizeof(*r->addrlen));
+		copy->keys = registry_alloc(NULL, r->capacity * sizeof(*r->keys));
+		memcpy(copy->addr, r->addr, r->nclients * sizeof(*r->addr));
+		memcpy(copy->addrlen, r->addrlen, r->nclients * sizeof(*r->addrlen));
+		memcpy(copy->keys, r->keys, r->nclients * sizeof(*r->keys));
+		copy->node = registry_alloc(NULL, r->capacity * sizeof(*r->node));
+		memcpy(copy->node, r->node, r->nclients * sizeof(*r->node));
+		copy->radio = registry_alloc(NULL, r->capacity * sizeof(*r->radio));
+		memcpy(copy->radio, r->radio, r->nclients * sizeof(*r->radio));
+		copy->channel = registry_alloc(NULL, r->capacity * sizeof(*r->channel));
+		memcpy(copy->channel, r->channel, r->nclients * sizeof(*r->channel));
+		copy->version = registry_alloc(NULL, r->capacity * sizeof(*r->version));
+		memcpy(copy->version, r->version, r->nclients * sizeof(*r->version));
+		copy->link = registry_alloc(NULL, r->capacity * sizeof(*r->link));
+		memcpy(copy->link, r->link, r->nclients * sizeof(*r->link));
+		copy->shm = registry_alloc(NULL, r->capacity * sizeof(*r->shm));
+		memcpy(copy->shm, r->shm, r->nclients * sizeof(*r->shm));
+		copy->members = registry_alloc(NULL, r->capacity * sizeof(*r->members));
+		memcpy(copy->members, r->members, r->nclients * sizeof(*r->members));
+	}
+	memcpy(copy->channel_first, r->channel_first, sizeof(r->channel_first));
+	copy->next_link = r->next_link;
+	if (r->node_client) {
+		copy->node_client = registry_alloc(NULL, nodes->nclients * sizeof(*r->node_client));
+		memcpy(copy->node_client, r->node_client, nodes->nclients * sizeof(*r->node_client));
+	}
+	if (r->nslots) {
+		copy->slots = registry_alloc(NULL, r->nslots * sizeof(*r->slots));
+		memcpy(copy->slots, r->slots, r->nslots * sizeof(*r->slots));
+	}
+	copy->nmacs = r->nmacs;
+	copy->nmac_slots = r->nmac_slots;
+	if (r->nmac_slots) {
+		copy->macs = registry_alloc(NULL, r->nmac_slots * sizeof(*r->macs));
+		memcpy(copy->macs, r->macs, r->nmac_slots * sizeof(*r->macs));
+	}
+
+	return copy;
+}
+
+/* drop the references a retired snapshot holds to the peer the next
+ * snapshot removed, and to the radios of its devices */
+void registry_release_peer(struct client_registry * r) {
+	int i;
+
+	for (i = 0; i < r->nclients; i++)
+		if (r->shm[i] == r->detached)
+			radio_put(r->radio[i]);
+	shm_peer_put(r->detached);
+}
+
+/* free the retired snapshots that no worker can still be reading.
+ * Must be called with registry_lock held */
+void registry_reclaim(void) {
+	struct client_registry ** p = &retired_registries, * r;
+	uint64_t oldest = UINT64_MAX, e;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		e = __atomic_load_n(&worker_epoch[i], __ATOMIC_SEQ_CST);
+		if (e && e < oldest)
+			oldest = e;
+	}
+
+	while ((r = *p)) {
+		if (r->retire_epoch <= oldest) {
+			*p = r->next_retired;
+			if (r->detached)
+				registry_release_peer(r);
+			registry_free(r);
+		} else
+			p = &r->next_retired;
+	}
+}
+
+/* replace the current snapshot. Must be called with registry_lock held */
+void registry_publish(struct client_registry * new) {
+	struct client_registry * old = registry;
+
+	registry_index_channels(new);
+	__atomic_store_n(&registry, new, __ATOMIC_SEQ_CST);
+
+	old->retire_epoch = __atomic_add_fetch(&registry_epoch, 1, __ATOMIC_SEQ_CST);
+	old->next_retired = retired_registries;
+	retired_registries = old;
+	registry_reclaim();
+}
+
+/* add a client to a new snapshot and return its index */
+int registry_add_client(struct client_registry * new, const struct client_key * key,
+						const struct sockaddr_storage * addr, socklen_t addrlen) {
+	int idx, node;
+
+	PRINTF("received a message from a new client, registering the client\n");
+	idx = registry_add(new, key, addr, addrlen);
+	if (collisions)
+		new->radio[idx] = radio_new();
+	if (nodes && (node = registry_find(nodes, key)) >= 0) {
+		new->node[idx] = node;
+		new->node_client[node] = idx;
+	}
+
+	return idx;
+}
+
+/* register a new client, unless another worker already did.
+ * The caller must be quiescent */
+void registry_register(const struct client_key * key,
+					   const struct sockaddr_storage * addr, socklen_t addrlen, uint8_t version) {
+	struct client_registry * new;
+	int idx;
+
+	pthread_mutex_lock(&registry_lock);
+
+	if (registry_find(registry, key) < 0) {
+		new = registry_copy(registry);
+		idx = registry_add_client(new, key, addr, addrlen);
+		new->version[idx] = version;
+		registry_publish(new);
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* register the devices of a client that negotiated a header version,
+ * through a socket or shared memory (peer is NULL for a socket).
+ * The caller must be quiescent */
+void registry_hello(const struct client_key * key, const struct sockaddr_storage * addr, socklen_t addrlen,
+					uint8_t version, int ndevices, struct shm_peer * peer) {
+	struct client_registry * new;
+	struct client_key k = *key;
+	int idx, i;
+
+	pthread_mutex_lock(&registry_lock);
+
+	new = registry_copy(registry);
+	for (i = 0; i < ndevices; i++) {
+		k.device = i;
+		if ( (idx = registry_find(new, &k)) < 0 )
+			idx = registry_add_client(new, &k, addr, addrlen);
+		new->version[idx] = version;
+		new->shm[idx] = peer;
+	}
+	registry_publish(new);
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* move a client (registering it if needed) to another channel.
+ * The caller must be quiescent */
+void registry_set_channel(const struct client_key * key,
+						  const struct sockaddr_storage * addr, socklen_t addrlen, uint8_t channel) {
+	struct client_registry * new;
+	int idx;
+
+	pthread_mutex_lock(&registry_lock);
+
+	idx = registry_find(registry, key);
+	if (idx < 0 || registry->channel[idx] != channel) {
+		PRINTF("a client moves to channel %d\n", channel);
+		new = registry_copy(registry);
+		if (idx < 0)
+			idx = registry_add_client(new, key, addr, addrlen);
+		new->channel[idx] = channel;
+		registry_publish(new);
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* copy a snapshot without the devices of a peer. The other clients keep
+ * their order, radio and link identifier, but move to another index:
+ * remap receives the new index of every client of r, -1 for the removed
+ * ones */
+struct client_registry * registry_without_peer(const struct client_registry * r,
+											   const struct shm_peer * peer, int * remap) {
+	struct client_registry * new;
+	struct mac_entry * e;
+	unsigned i;
+	int c, idx;
+
+	new = (struct client_registry *) calloc(1, sizeof(*new));
+	if (!new) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (r->node_client) {
+		new->node_client = registry_alloc(NULL, (nodes->nclients + 1) * sizeof(*new->node_client));
+		for (c = 0; c < nodes->nclients; c++)
+			new->node_client[c] = -1;
+	}
+
+	for (c = 0; c < r->nclients; c++) {
+		if (r->shm[c] == peer) {
+			remap[c] = -1;
+			continue;
+		}
+		idx = remap[c] = registry_add(new, &r->keys[c], &r->addr[c], r->addrlen[c]);
+		new->node[idx] = r->node[c];
+		new->radio[idx] = r->radio[c];
+		new->channel[idx] = r->channel[c];
+		new->version[idx] = r->version[c];
+		new->link[idx] = r->link[c];
+		new->shm[idx] = r->shm[c];
+		if (r->node[c] >= 0)
+			new->node_client[r->node[c]] = idx;
+	}
+	new->next_link = r->next_link;
+
+	for (i = 0; i < r->nmac_slots; i++) {
+		e = &r->macs[i];
+		if (e->client && remap[e->client - 1] >= 0)
+			registry_add_mac(new, &e->key, remap[e->client - 1],
+							 __atomic_load_n(&e->last_seen, __ATOMIC_RELAXED));
+	}
+
+	return new;
+}
+
+/* publish a snapshot without the devices of a peer that left. The peer and
+ * the radios of its devices are released along with the snapshot this one
+ * replaces. Returns the new index of the former clients (see
+ * registry_without_peer()), their number in nold, to be freed by the
+ * caller. The caller must be quiescent */
+int * registry_remove_peer(struct shm_peer * peer, int * nold) {
+	struct client_registry * new;
+	int * remap;
+
+	pthread_mutex_lock(&registry_lock);
+
+	*nold = registry->nclients;
+	remap = registry_alloc(NULL, (*nold + 1) * sizeof(*remap));
+	new = registry_without_peer(registry, peer, remap);
+	registry->detached = peer;
+	registry_publish(new);
+
+	pthread_mutex_unlock(&registry_lock);
+
+	return remap;
+}
+
+/* learn that a client sends from an address, unless another worker already
+ * did. The caller must be quiescent */
+void registry_learn(const struct mac_key * key, int client) {
+	struct client_registry * new;
+	const struct mac_entry * e;
+
+	pthread_mutex_lock(&registry_lock);
+
+	e = registry_find_mac_entry(registry, key);
+	if (!e || (e->client - 1 != client && mac_entry_idle(e, bench_now()))) {
+		PRINTF("client %d sends from a new address\n", client);
+		new = registry_copy(registry);
+		registry_add_mac(new, key, client, bench_now());
+		registry_publish(new);
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* datagrams waiting to be sent with sendmmsg(). The vector points at the
+ * buffers of the caller, which must stay valid until the batch is flushed */
+struct tx_batch {
+	struct mmsghdr msgs[FANOUT_BATCH];
+	struct iovec iov[FANOUT_BATCH][2];
+	uint8_t header[FANOUT_BATCH][ENCAP_HEADER_LEN]; /* per destination */
+	int n;
+};
+
+/* send the batch. sendmmsg() stops at the first destination that fails:
+ * report it and resume with the next one */
+void tx_batch_flush(int sock, struct tx_batch * b) {
+	int ret, sent = 0;
+
+	while (sent < b->n) {
+		ret = sendmmsg(sock, b->msgs + sent, b->n - sent, 0);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			PRINTF("unable to send a packet: %s\n", strerror(errno));
+			ret = 1;
+		}
+		sent += ret;
+	}
+
+	b->n = 0;
+}
+
+/* queue a datagram, made of an optional header (copied) and a buffer */
+void tx_batch_add(int sock, struct tx_batch * b, const struct sockaddr_storage * addr,
+				  socklen_t addrlen, const uint8_t * header, void * buffer, size_t len) {
+	struct mmsghdr * m;
+	struct iovec * iov;
+
+	if (b->n == FANOUT_BATCH)
+		tx_batch_flush(sock, b);
+
+	iov = b->iov[b->n];
+	m = &b->msgs[b->n];
+	memset(m, 0, sizeof(*m));
+	m->msg_hdr.msg_name = (void *) addr;
+	m->msg_hdr.msg_namelen = addrlen;
+	m->msg_hdr.msg_iov = iov;
+	if (header) {
+		memcpy(b->header[b->n], header, ENCAP_HEADER_LEN);
+		iov->iov_base = b->header[b->n];
+		iov->iov_len = ENCAP_HEADER_LEN;
+		iov++;
+		m->msg_hdr.msg_iovlen++;
+	}
+	iov->iov_base = buffer;
+	iov->iov_len = len;
+	m->msg_hdr.msg_iovlen++;
+	b->n++;
+}
+
+/* hierarchical timer wheel holding the delayed frames of a worker: four
+ * levels of 64 slots, each slot of a level covering a whole turn of the
+ * level below, so that scheduling and expiring a frame are O(1). An entry
+ * is moved down a level (cascaded) when the lower level wraps around. */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELAY (((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1) /* ticks */
+#define WHEEL_POOL_CHUNK 1024
+#define DELAYED_FRAME_MAX 256 /* longer datagrams are not delayed but dropped */
+
+struct wheel_entry {
+	struct wheel_entry * next;
+	uint64_t expires; /* tick */
+	struct radio * radio; /* receiver, with the collision engine */
+	struct airtime * frame; /* at the receiver (see airtime_start()) */
+	struct shm_peer * peer; /* receiver attached through shared memory */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	size_t len;
+	char data[DELAYED_FRAME_MAX];
+};
+
+struct wheel_slot {
+	struct wheel_entry * head, ** tail; /* frames keep their order */
+};
+
+struct timer_wheel {
+	uint64_t now; /* next tick to process */
+	struct wheel_slot slots[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t occupied[WHEEL_LEVELS]; /* bitmap of non empty slots */
+	unsigned long pending;
+	struct wheel_entry * free;
+};
+
+uint64_t wheel_tick_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec) / WHEEL_TICK_NS;
+}
+
+void wheel_init(struct timer_wheel * w) {
+	int l, i;
+
+	memset(w, 0, sizeof(*w));
+	for (l = 0; l < WHEEL_LEVELS; l++)
+		for (i = 0; i < WHEEL_SIZE; i++)
+			w->slots[l][i].tail = &w->slots[l][i].head;
+	w->now = wheel_tick_now();
+}
+
+struct wheel_entry * wheel_alloc(struct timer_wheel * w) {
+	struct wheel_entry * e;
+	int i;
+
+	if (!w->free) {
+		e = (struct wheel_entry *) malloc(WHEEL_POOL_CHUNK * sizeof(*e));
+		if (!e) {
+			perror("malloc()");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < WHEEL_POOL_CHUNK; i++) {
+			e[i].next = w->free;
+			w->free = &e[i];
+		}
+	}
+
+	e = w->free;
+	w->free = e->next;
+	return e;
+}
+
+void wheel_release(struct timer_wheel * w, struct wheel_entry * e) {
+	e->next = w->free;
+	w->free = e;
+}
+
+/* file an entry in the slot matching its expiration */
+void wheel_insert(struct timer_wheel * w, struct wheel_entry * e) {
+	uint64_t delta = e->expires > w->now ? e->expires - w->now : 0;
+	struct wheel_slot * slot;
+	int level = 0, idx;
+
+	if (delta > WHEEL_MAX_DELAY) {
+		e->expires = w->now + WHEEL_MAX_DELAY;
+		delta = WHEEL_MAX_DELAY;
+	}
+	if (!delta)
+		e->expires = w->now;
+
+	while (delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1))))
+		level++;
+
+	idx = (e->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	slot = &w->slots[level][idx];
+	e->next = NULL;
+	*slot->tail = e;
+	slot->tail = &e->next;
+	w->occupied[level] |= (uint64_t) 1 << idx;
+}
+
+struct wheel_entry * wheel_slot_take(struct timer_wheel * w, int level, int idx) {
+	struct wheel_slot * slot = &w->slots[level][idx];
+	struct wheel_entry * head = slot->head;
+
+	slot->head = NULL;
+	slot->tail = &slot->head;
+	w->occupied[level] &= ~((uint64_t) 1 << idx);
+	return head;
+}
+
+/* tick at which the wheel needs to be processed next: the next non empty
+ * slot of the first level, or else the cascade of the next non empty slot of
+ * an upper level, or the wrap around of a level whose slots hold entries for
+ * its next turn */
+uint64_t wheel_next(const struct timer_wheel * w) {
+	uint64_t next = w->now, pending;
+	int level, idx;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		idx = (next >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+		if (!idx) /* the upper levels cascade at this tick */
+			return next;
+		pending = w->occupied[level] >> idx;
+		if (pending)
+			return next + ((uint64_t) __builtin_ctzll(pending) << (WHEEL_BITS * level));
+		next = (next | (((uint64_t) 1 << (WHEEL_BITS * (level + 1))) - 1)) + 1;
+		if (w->occupied[level]) /* slots for the next turn of this level */
+			return next;
+	}
+
+	return next;
+}
+
+/* schedule a copy of a frame for addr, delay ticks from now */
+struct wheel_entry * wheel_schedule(struct timer_wheel * w, uint32_t delay, const struct sockaddr_storage * addr,
+									socklen_t addrlen, const uint8_t * header, const void * buffer, size_t len) {
+	struct wheel_entry * e;
+	size_t hlen = header ? ENCAP_HEADER_LEN : 0;
+	uint64_t now;
+
+	if (hlen + len > DELAYED_FRAME_MAX) {
+		PRINTF("frame too long (%zu bytes) to be delayed, dropping it\n", len);
+		return NULL;
+	}
+
+	/* catch up with the ticks that have nothing to process, all of them
+	 * when the wheel is empty, so that the delay counts from now */
+	now = wheel_tick_now();
+	if (!w->pending)
+		w->now = now;
+	else if (w->now < now)
+		w->now = wheel_next(w) < now ? wheel_next(w) : now;
+
+	e = wheel_alloc(w);
+	e->expires = now + delay;
+	e->radio = NULL;
+	e->peer = NULL;
+	memcpy(&e->addr, addr, addrlen);
+	e->addrlen = addrlen;
+	e->len = hlen + len;
+	memcpy(e->data, header, hlen);
+	memcpy(e->data + hlen, buffer, len);
+
+	wheel_insert(w, e);
+	w->pending++;
+	return e;
+}
+
+/* process the ticks up to the current time, skipping those with nothing to
+ * expire nor cascade, and return the list of the expired entries, in order */
+struct wheel_entry * wheel_expire(struct timer_wheel * w) {
+	struct wheel_entry * expired = NULL, ** tail = &expired, * e, * next;
+	uint64_t target = wheel_tick_now();
+	int level, idx;
+
+	if (!w->pending) {
+		w->now = target + 1;
+		return NULL;
+	}
+
+	while (w->now <= target) {
+		/* cascade the upper levels when the lower ones wrap around */
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if (w->now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1))
+				break;
+			idx = (w->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+			for (e = wheel_slot_take(w, level, idx); e; e = next) {
+				next = e->next;
+				wheel_insert(w, e);
+			}
+		}
+
+		idx = w->now & (WHEEL_SIZE - 1);
+		if (w->occupied[0] & ((uint64_t) 1 << idx)) {
+			*tail = wheel_slot_take(w, 0, idx);
+			while (*tail) {
+				w->pending--;
+				tail = &(*tail)->next;
+			}
+		}
+
+		if (!w->pending) {
+			w->now = target + 1;
+			break;
+		}
+		/* entries scheduled later may expire right after target */
+		w->now++;
+		w->now = wheel_next(w);
+		if (w->now > target)
+			w->now = target + 1;
+	}
+
+	return expired;
+}
+
+void print_version() {
+	printf("This software is provided \"AS IS.\"\n"
+		    "NIST MAKES NO WARRANTY OF ANY KIND, EXPRESS, IMPLIED"
+		    "OR STATUTORY, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF"
+		    "MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT"
+		    "AND DATA ACCURACY.  NIST does not warrant or make any representations"
+		    "regarding the use of the software or the results thereof, including but"
+		    "not limited to the correctness, accuracy, reliability or usefulness of"
+		    "this software.\n"
+			"\n"
+			"Written by Tony Cheneau <tony.cheneau@nist.gov>\n");
+    printf("Version 0.1\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+void print_usage(const char * prgname) {
+	printf("This program a minimalist UDP broker.\n"
+			"A new client is first detected when it sends a message to the broker.\n"
+			"Subsequently, all messages received by the broker will be send to"
+			"all the clients (except the one sending the message), or only to its\n"
+			"neighbours when a topology is given\n");
+
+	printf("usage: %s -l portnum [-u shm:/name] [-u unix:/path] [-t topology | -p positions] [-c] [-m] [-V idle_us] [-w pcapfile [-C size] [-G seconds] [-P]] [-j workers] [-a cpu]\n", prgname);
+	printf("       %s -b nodes\n", prgname);
+	printf("       %s -T frames\n", prgname);
+	printf("-l, --local-port: local udp port to be bound\n");
+	printf("-u, --listen: also accept the local fakeserial processes that use shared memory (-u shm:/name),\n"
+		   "              or a unix datagram socket (-u unix:/path). May be given once for each\n");
+	printf("-w, --write: write all the packet to a pcap file\n");
+	printf("-C, --file-size: start a new pcap file (pcapfile.1, pcapfile.2, ...) once the current one reaches size millions of bytes\n");
+	printf("-G, --rotate-seconds: start a new pcap file every seconds\n");
+	printf("-P, --pcapng: write a pcapng file, with one interface per client\n");
+	printf("-t, --topology: only relay packets along the links described in this file, one link per line:\n"
+		   "                src dst loss delay_us lqi (src and dst as ipv4:port or [ipv6]:port)\n");
+	printf("-p, --positions: only relay packets to the clients within the range of the sender, one node per line:\n"
+		   "                 node x y z range (node as ipv4:port or [ipv6]:port), SIGHUP reloads the file\n");
+	printf("-c, --collisions: deliver the frames at the end of their airtime, and drop the frames that\n"
+		   "                  overlap at a receiver. Receivers are told when their channel is busy\n");
+	printf("-m, --promiscuous: relay the unicast frames to every client as well, instead of their\n"
+		   "                   destination only (learnt from the source addresses of the frames)\n");
+	printf("-V, --virtual-time: drive the virtual clock of the clients started with -V: once nothing went\n"
+		   "                    through the broker for idle_us microseconds, skip the time until the next\n"
+		   "                    frame is due. Requires a single worker\n");
+	printf("-b, --benchmark: measure the cost of the range queries for this number of nodes and exit\n");
+	printf("-T, --transport-benchmark: compare the rate and latency of UDP loopback and unix sockets\n"
+		   "                           for this number of frames and exit\n");
+	printf("-j, --jobs: number of worker threads, each with its own SO_REUSEPORT socket (default: 1)\n");
+	printf("-a, --affinity: pin worker i on CPU (cpu + i)\n");
+	printf("-v, --version: print the program version\n");
+	printf("-h, --help: print this help message\n");
+}
+
+int ipv6_server_setup(const char * lport, int reuseport) {
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+    int sfd, s, pass, yes = 1, no = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
+    hints.ai_flags = AI_PASSIVE;    /* For wildcard IP address */
+    hints.ai_protocol = 0;          /* Any protocol */
+    hints.ai_canonname = NULL;
+    hints.ai_addr = NULL;
+    hints.ai_next = NULL;
+
+    s = getaddrinfo(NULL, lport, &hints, &result);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        exit(EXIT_FAILURE);
+    }
+
+    /* getaddrinfo() returns a list of address structures.
+       Try each address until we successfully bind(2).
+       If socket(2) (or bind(2)) fails, we (close the socket
+       and) try the next address.
+       IPv6 addresses are tried first: the socket is then dual-stack
+       and IPv4 clients show up as IPv4-mapped addresses. */
+    for (pass = 0, rp = NULL; pass < 2 && rp == NULL; pass++) {
+        for (rp = result; rp != NULL; rp = rp->ai_next) {
+            if (pass == 0 && rp->ai_family != AF_INET6)
+                continue;
+
+            sfd = socket(rp->ai_family, rp->ai_socktype,
+                    rp->ai_protocol);
+            if (sfd == -1)
+                continue;
+
+            if (rp->ai_family == AF_INET6)
+                setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+
+            /* every worker binds its own socket on the same port, and the
+               kernel spreads the clients among them */
+            if (reuseport &&
+                setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+                perror("setsockopt()");
+                exit(EXIT_FAILURE);
+            }
+
+            if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
+                break;                  /* Success */
+
+            close(sfd);
+        }
+    }
+
+    if (rp == NULL) {               /* No address succeeded */
+        fprintf(stderr, "Could not bind\n");
+        exit(EXIT_FAILURE);
+    }
+
+    freeaddrinfo(result);           /* No longer needed */
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes,
+				   sizeof(int)) == -1) {
+		perror("setsockopt()");
+		exit(EXIT_FAILURE);
+	}
+
+	return sfd;
+}
+
+/* bind the unix datagram socket of the local clients (-u unix:/path). A
+ * socket file left by a previous run is replaced */
+int unix_server_setup(const char * path) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "unix socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(sun.sun_path, path);
+
+	if ( (fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		perror("unable to bind the unix socket");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+#define BENCH_FRAME_LEN (ENCAP_HEADER_LEN + 127) /* largest datagram a client sends */
+
+/* an endpoint of the transport benchmark, bound to an address of its own
+ * (a loopback port, or an autobound abstract unix name) */
+struct bench_endpoint {
+	int sock;
+	struct sockaddr_storage addr;
 	socklen_t addrlen;
-	struct client_list * next;
+	int count; /* frames to receive */
+	int received;
+	uint64_t last; /* date of the last frame received */
+};
+
+void bench_endpoint_open(struct bench_endpoint * e, int family) {
+	struct sockaddr_in sin;
+	struct timeval tv = { 1, 0 }; /* in case UDP drops a frame of a round trip */
+	int size = 4 << 20;
+
+	memset(e, 0, sizeof(*e));
+	if ( (e->sock = socket(family, SOCK_DGRAM, 0)) < 0 ) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(e->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(e->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = family;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(e->sock, (struct sockaddr *) &sin, family == AF_INET ? sizeof(sin) : sizeof(sa_family_t)) < 0) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	e->addrlen = sizeof(e->addr);
+	getsockname(e->sock, (struct sockaddr *) &e->addr, &e->addrlen);
+}
+
+/* count the frames until they are all there, or until none came for a
+ * while (UDP may drop some) */
+void * bench_sink(void * arg) {
+	struct bench_endpoint * e = (struct bench_endpoint *) arg;
+	struct timeval tv = { 0, 200000 };
+	uint8_t buf[BENCH_FRAME_LEN];
+
+	setsockopt(e->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (e->received < e->count && recv(e->sock, buf, sizeof(buf), 0) >= 0) {
+		e->received++;
+		e->last = bench_now();
+	}
+
+	return NULL;
+}
+
+/* send every frame back to where it came from, until an empty datagram */
+void * bench_echo(void * arg) {
+	struct bench_endpoint * e = (struct bench_endpoint *) arg;
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	uint8_t buf[BENCH_FRAME_LEN];
+	ssize_t len;
+
+	do {
+		fromlen = sizeof(from);
+		if ( (len = recvfrom(e->sock, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen)) > 0 )
+			sendto(e->sock, buf, len, 0, (struct sockaddr *) &from, fromlen);
+	} while (len != 0);
+
+	return NULL;
+}
+
+int bench_compare(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* compare the UDP loopback with a unix datagram socket: rate at which a
+ * sender pushes nframes frames to a receiver, and round trip time of a
+ * frame sent to an echo thread, as a client and the broker would */
+void transport_benchmark(int nframes) {
+	static const int families[] = { AF_INET, AF_UNIX };
+	int nrounds = nframes < 10000 ? nframes : 10000;
+	uint64_t * rtt = registry_alloc(NULL, nrounds * sizeof(uint64_t));
+	uint8_t frame[BENCH_FRAME_LEN];
+	struct bench_endpoint src, dst;
+	uint64_t start, total;
+	pthread_t thread;
+	int f, i;
+
+	memset(frame, 0x5a, sizeof(frame));
+	printf("transport benchmark: %d frames of %d bytes, %d round trips\n", nframes, BENCH_FRAME_LEN, nrounds);
+	printf("%14s %14s %10s %16s %16s\n", "transport", "frames/s", "lost", "rtt avg (us)", "rtt p99 (us)");
+
+	for (f = 0; f < (int) (sizeof(families) / sizeof(families[0])); f++) {
+		bench_endpoint_open(&src, families[f]);
+		bench_endpoint_open(&dst, families[f]);
+
+		/* throughput */
+		dst.count = nframes;
+		if ( (errno = pthread_create(&thread, NULL, bench_sink, &dst)) != 0 ) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+		start = bench_now();
+		for (i = 0; i < nframes; i++)
+			if (sendto(src.sock, frame, sizeof(frame), 0, (struct sockaddr *) &dst.addr, dst.addrlen) < 0)
+				perror("sendto()");
+		pthread_join(thread, NULL);
+
+		/* latency */
+		if ( (errno = pthread_create(&thread, NULL, bench_echo, &dst)) != 0 ) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0, total = 0; i < nrounds; i++) {
+			rtt[i] = bench_now();
+			sendto(src.sock, frame, sizeof(frame), 0, (struct sockaddr *) &dst.addr, dst.addrlen);
+			recv(src.sock, frame, sizeof(frame), 0);
+			rtt[i] = bench_now() - rtt[i];
+			total += rtt[i];
+		}
+		sendto(src.sock, frame, 0, 0, (struct sockaddr *) &dst.addr, dst.addrlen);
+		pthread_join(thread, NULL);
+		qsort(rtt, nrounds, sizeof(uint64_t), bench_compare);
+
+		printf("%14s %14.0f %10d %16.1f %16.1f\n", families[f] == AF_INET ? "udp loopback" : "unix socket",
+			   dst.received && dst.last > start ? dst.received * 1e9 / (dst.last - start) : 0,
+			   nframes - dst.received, total / 1e3 / nrounds, rtt[nrounds * 99 / 100] / 1e3);
+
+		close(src.sock);
+		close(dst.sock);
+	}
+
+	free(rtt);
+}
+
+/* from the pcap.h */
+struct pcap_file_header
+{
+    uint32_t    magic;
+    uint16_t    version_major;
+    uint16_t    version_minor;
+    int32_t     thiszone;
+    uint32_t    sigfigs;
+    uint32_t    snaplen;
+    uint32_t    linktype;
+};
+
+struct pcap_pkthdr {
+        uint32_t ts_sec;     /* time stamp (second) */
+        uint32_t ts_msec;    /* time stamp (microseconds) */
+        uint32_t caplen;     /* length of portion present */
+        uint32_t len;        /* length this packet (off wire) */
+};
+
+/* from the pcapng specification, see
+ * https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-01.html */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+#define LINKTYPE_IEEE802_15_4 195 /* IEEE 802.15.4 + FCS, see http://www.tcpdump.org/linktypes.html */
+#define CAPTURE_SNAPLEN 127 /* max MTU on IEEE 802.15.4 links */
+#define CAPTURE_RING_SIZE 4096 /* records per worker, a power of two */
+#define CAPTURE_BLOCK (64 * 1024) /* the writer issues writes of this size */
+#define CAPTURE_FLUSH_INTERVAL 1 /* seconds, when the capture is idle */
+#define CAPTURE_IDLE_SLEEP (10 * 1000 * 1000) /* nanoseconds */
+
+/* the capture must never slow the forwarding down: each worker copies the
+ * frames it receives into its own single-producer single-consumer ring, and
+ * a writer thread drains the rings to the file in large blocks. A frame is
+ * dropped (and counted) when the ring of its worker is full */
+struct capture_record {
+    uint64_t ts; /* nanoseconds since the epoch */
+    uint32_t iface; /* index of the sending client */
+    uint32_t len;
+    uint32_t caplen;
+    uint8_t data[CAPTURE_SNAPLEN];
+};
+
+struct capture_ring {
+    struct capture_record records[CAPTURE_RING_SIZE];
+    /* written by the worker */
+    unsigned head __attribute__((aligned(64)));
+    uint64_t drops;
+    /* written by the writer thread */
+    unsigned tail __attribute__((aligned(64)));
+};
+
+static struct capture {
+    const char * file;
+    int pcapng;
+    uint64_t max_size; /* bytes per file, 0 for no limit */
+    unsigned rotate_seconds; /* 0 for no time based rotation */
+
+    struct capture_ring ** rings;
+    int nrings;
+    sigset_t signals; /* terminate the capture cleanly */
+    int stop_fd; /* signalfd of the above, watched by the workers */
+    pthread_t writer;
+    int stopped; /* the workers are done */
+
+    int fd;
+    int nfiles;
+    uint64_t file_size;
+    uint64_t file_start;
+    uint32_t nifaces; /* interfaces described in the current pcapng file */
+    uint8_t * block;
+    size_t used;
+    time_t last_flush;
+    uint64_t drops_reported;
+} capture = { .fd = -1, .stop_fd = -1 };
+
+uint64_t capture_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* queue a frame received by a worker, never blocks */
+void capture_push(struct capture_ring * ring, uint64_t ts, int iface,
+                  const void * packet, size_t packet_len) {
+    struct capture_record * rec;
+    unsigned head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == CAPTURE_RING_SIZE) {
+        __atomic_store_n(&ring->drops, ring->drops + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &ring->records[head & (CAPTURE_RING_SIZE - 1)];
+    rec->ts = ts;
+    rec->iface = iface;
+    rec->len = packet_len;
+    rec->caplen = packet_len < CAPTURE_SNAPLEN ? packet_len : CAPTURE_SNAPLEN;
+    memcpy(rec->data, packet, rec->caplen);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* write the pending block to the file */
+void capture_flush(void) {
+    size_t off = 0;
+    ssize_t ret;
+
+    while (off < capture.used) {
+        ret = write(capture.fd, capture.block + off, capture.used - off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        off += ret;
+    }
+
+    capture.used = 0;
+    capture.last_flush = time(NULL);
+}
+
+void capture_append(const void * data, size_t len) {
+    if (capture.used + len > CAPTURE_BLOCK)
+        capture_flush();
+
+    memcpy(capture.block + capture.used, data, len);
+    capture.used += len;
+    capture.file_size += len;
+}
+
+void capture_append_u32(uint32_t v) {
+    capture_append(&v, sizeof(v));
+}
+
+void pcap_write_header(void) {
+    struct pcap_file_header header;
+
+    /* see pcap-savefile(5) */
+    header.magic = 0xa1b2c3d4;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.thiszone = 0;
+    header.sigfigs = 0;
+    header.snaplen = CAPTURE_SNAPLEN;
+    header.linktype = LINKTYPE_IEEE802_15_4;
+
+    capture_append(&header, sizeof(header));
+}
+
+void pcap_write_packet(const struct capture_record * rec) {
+    struct pcap_pkthdr header;
+
+    /* force casting to 32 bit */
+    header.ts_sec = (uint32_t) (rec->ts / 1000000000);
+    header.ts_msec = (uint32_t) (rec->ts % 1000000000 / 1000);
+    header.caplen = rec->caplen;
+    header.len = rec->len;
+
+    capture_append(&header, sizeof(header));
+    capture_append(rec->data, rec->caplen);
+}
+
+void pcapng_write_header(void) {
+    int64_t section_len = -1; /* not specified */
+    uint16_t version[2] = { 1, 0 };
+
+    capture_append_u32(PCAPNG_SHB);
+    capture_append_u32(28);
+    capture_append_u32(PCAPNG_BYTE_ORDER_MAGIC);
+    capture_append(version, sizeof(version));
+    capture_append(&section_len, sizeof(section_len));
+    capture_append_u32(28);
+}
+
+/* each client is described by its own interface */
+void pcapng_write_interface(uint32_t iface) {
+    uint16_t linktype[2] = { LINKTYPE_IEEE802_15_4, 0 };
+    uint16_t opt[2];
+    uint8_t tsresol[4] = { 9, 0, 0, 0 }; /* nanoseconds */
+    char name[32];
+    uint32_t name_len, padded, total;
+
+    name_len = snprintf(name, sizeof(name), "client%u", iface);
+    padded = (name_len + 3) & ~3;
+    memset(name + name_len, 0, sizeof(name) - name_len);
+    total = 20 + 4 + padded + 4 + 4 + 4;
+
+    capture_append_u32(PCAPNG_IDB);
+    capture_append_u32(total);
+    capture_append(linktype, sizeof(linktype));
+    capture_append_u32(CAPTURE_SNAPLEN);
+    opt[0] = PCAPNG_OPT_IF_NAME;
+    opt[1] = name_len;
+    capture_append(opt, sizeof(opt));
+    capture_append(name, padded);
+    opt[0] = PCAPNG_OPT_IF_TSRESOL;
+    opt[1] = 1;
+    capture_append(opt, sizeof(opt));
+    capture_append(tsresol, sizeof(tsresol));
+    opt[0] = PCAPNG_OPT_ENDOFOPT;
+    opt[1] = 0;
+    capture_append(opt, sizeof(opt));
+    capture_append_u32(total);
+}
+
+void pcapng_write_packet(const struct capture_record * rec) {
+    static const uint8_t padding[3];
+    uint32_t padded = (rec->caplen + 3) & ~3;
+    uint32_t total = 32 + padded;
+
+    while (capture.nifaces <= rec->iface)
+        pcapng_write_interface(capture.nifaces++);
+
+    capture_append_u32(PCAPNG_EPB);
+    capture_append_u32(total);
+    capture_append_u32(rec->iface);
+    capture_append_u32(rec->ts >> 32);
+    capture_append_u32(rec->ts & 0xffffffff);
+    capture_append_u32(rec->caplen);
+    capture_append_u32(rec->len);
+    capture_append(rec->data, rec->caplen);
+    capture_append(padding, padded - rec->caplen);
+    capture_append_u32(total);
+}
+
+/* open the next capture file: the first one is named after -w, the
+ * following ones get a numeric suffix */
+void capture_open(void) {
+    char name[PATH_MAX];
+
+    if (capture.nfiles)
+        snprintf(name, sizeof(name), "%s.%d", capture.file, capture.nfiles);
+    else
+        snprintf(name, sizeof(name), "%s", capture.file);
+
+    PRINTF("opening pcap file %s\n", name);
+    capture.fd = open(name, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IRGRP);
+
+    if (capture.fd < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    capture.nfiles++;
+    capture.file_size = 0;
+    capture.file_start = capture_now();
+    capture.nifaces = 0;
+
+    if (capture.pcapng)
+        pcapng_write_header();
+    else
+        pcap_write_header();
+}
+
+void capture_close(void) {
+    capture_flush();
+    close(capture.fd);
+}
+
+void capture_write_record(const struct capture_record * rec) {
+    int rotate = 0;
+
+    if (capture.max_size &&
+        capture.file_size + sizeof(struct pcap_pkthdr) + 32 + rec->caplen > capture.max_size)
+        rotate = 1;
+    if (capture.rotate_seconds &&
+        rec->ts >= capture.file_start + (uint64_t) capture.rotate_seconds * 1000000000)
+        rotate = 1;
+
+    if (rotate) {
+        capture_close();
+        capture_open();
+    }
+
+    if (capture.pcapng)
+        pcapng_write_packet(rec);
+    else
+        pcap_write_packet(rec);
+}
+
+/* move the records of every ring to the file, the oldest first
+ * returns the number of records written */
+int capture_drain(void) {
+    struct capture_ring * ring, * oldest;
+    struct capture_record * rec;
+    int i, n = 0;
+
+    while (1) {
+        oldest = NULL;
+        for (i = 0; i < capture.nrings; i++) {
+            ring = capture.rings[i];
+            if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+                continue;
+            if (!oldest ||
+                ring->records[ring->tail & (CAPTURE_RING_SIZE - 1)].ts <
+                oldest->records[oldest->tail & (CAPTURE_RING_SIZE - 1)].ts)
+                oldest = ring;
+        }
+
+        if (!oldest)
+            return n;
+
+        rec = &oldest->records[oldest->tail & (CAPTURE_RING_SIZE - 1)];
+        capture_write_record(rec);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+}
+
+void capture_report_drops(void) {
+    uint64_t drops = 0;
+    int i;
+
+    for (i = 0; i < capture.nrings; i++)
+        drops += __atomic_load_n(&capture.rings[i]->drops, __ATOMIC_RELAXED);
+
+    if (drops != capture.drops_reported) {
+        fprintf(stderr, "capture: %llu frames dropped (ring full)\n", (unsigned long long) drops);
+        capture.drops_reported = drops;
+    }
+}
+
+/* writer thread, until the workers stopped (see capture_stop()): the last
+ * frames then reach the file before it is closed */
+void * capture_run(void * arg) {
+    struct timespec idle = { 0, CAPTURE_IDLE_SLEEP };
+
+    (void) arg;
+
+    while (!__atomic_load_n(&capture.stopped, __ATOMIC_ACQUIRE)) {
+        if (capture_drain())
+            continue;
+
+        if (time(NULL) - capture.last_flush >= CAPTURE_FLUSH_INTERVAL) {
+            if (capture.used)
+                capture_flush();
+            capture.last_flush = time(NULL);
+            capture_report_drops();
+        }
+
+        nanosleep(&idle, NULL);
+    }
+
+    capture_drain();
+    capture_close();
+    capture_report_drops();
+    return NULL;
+}
+
+/* prepare the capture and start the writer thread, once the rings of the
+ * workers are allocated */
+void capture_start(void) {
+    if (posix_memalign((void **) &capture.block, 4096, CAPTURE_BLOCK) != 0) {
+        perror("posix_memalign()");
+        exit(EXIT_FAILURE);
+    }
+
+    capture_open();
+    capture.last_flush = time(NULL);
+
+    if ( (errno = pthread_create(&capture.writer, NULL, capture_run, NULL)) != 0 ) {
+        perror("pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* let the writer empty the rings and close the file, once the workers are
+ * stopped */
+void capture_stop(void) {
+    __atomic_store_n(&capture.stopped, 1, __ATOMIC_RELEASE);
+    pthread_join(capture.writer, NULL);
+}
+
+static const char * shm_name; /* NULL without -u shm:/name */
+static int unix_sock = -1; /* with -u unix:/path, shared by the workers */
+
+/* send a datagram to a client attached through shared memory */
+void shm_peer_send(struct shm_peer * peer, const uint8_t * header, const void * buffer, size_t len) {
+	uint64_t one = 1;
+	int ret;
+
+	if (__atomic_load_n(&peer->dead, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&peer->lock);
+	ret = shm_ring_push(&peer->area->to_client, header, header ? ENCAP_HEADER_LEN : 0, buffer, len);
+	if (ret < 0)
+		peer->drops++;
+	pthread_mutex_unlock(&peer->lock);
+
+	if (ret > 0 && write(peer->efd_out, &one, sizeof(one)) < 0) {
+		PRINTF("unable to wake up a client: %s\n", strerror(errno));
+	}
+}
+
+struct worker {
+	int id;
+	int sock;
+	int epfd; /* -1 when the worker only waits on its socket */
+	int cpu; /* -1 when not pinned */
+	pthread_t thread;
+	unsigned long int packet_seq;
+	struct capture_ring * capture; /* NULL without -w */
+	/* with a topology */
+	struct timer_wheel * wheel;
+	int timerfd;
+	uint64_t armed; /* tick the timer is armed for, 0 if none */
+	uint64_t rng;
+	int * neighbours; /* with positions, one entry per node */
+	/* with the collision engine, airtime of the frame being relayed */
+	uint64_t start; /* tick */
+	uint32_t airtime; /* ticks */
+	uint8_t busy[ENCAP_CONTROL_MAX_LEN]; /* control message, the airtime from busy[2] */
+	/* frame being relayed, and the header it came with (a bare frame gets
+	 * one with its sequence number and date set to 0) */
+	struct encap_header header;
+	uint8_t * frame;
+	int unicast; /* client the frame is for, -1 to relay it to every client */
+	uint8_t buffer[BUFSIZE];
+	struct tx_batch batch;
+	struct tx_batch unix_batch; /* for the clients of the unix socket */
 };
 
+/* queue a datagram on the socket the client is reachable through */
+void worker_send(struct worker * w, const struct sockaddr_storage * addr, socklen_t addrlen,
+				 const uint8_t * header, void * buffer, size_t len) {
+	if (addr->ss_family == AF_UNIX)
+		tx_batch_add(unix_sock, &w->unix_batch, addr, addrlen, header, buffer, len);
+	else
+		tx_batch_add(w->sock, &w->batch, addr, addrlen, header, buffer, len);
+}
+
+void worker_flush(struct worker * w) {
+	tx_batch_flush(w->sock, &w->batch);
+	tx_batch_flush(unix_sock, &w->unix_batch);
+}
+
+/* xorshift64*, one generator per worker */
+uint32_t worker_random(struct worker * w) {
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return (w->rng * 2685821657736338717ull) >> 32;
+}
+
+/* start relaying a frame: with the collision engine, compute its airtime
+ * and keep the sender busy while it transmits (it cannot receive at the
+ * same time) */
+void fanout_begin(struct worker * w, const struct client_registry * r, int sender, size_t len) {
+	uint32_t airtime_us = (len + PHY_HEADER_LEN) * PHY_BYTE_US;
+	uint8_t airtime[2];
+
+	if (!collisions)
+		return;
+
+	w->start = wheel_tick_now();
+	w->airtime = (airtime_us * 1000 + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+	airtime[0] = airtime_us >> 8;
+	airtime[1] = airtime_us & 0xff;
+	encap_control_write(w->busy, BUSY_NOTIFICATION, airtime, sizeof(airtime));
+
+	airtime_start(r->radio[sender], w->start, w->start, w->start + w->airtime, 0);
+}
+
+void fanout_end(struct worker * w) {
+	worker_flush(w);
+}
+
+/* send a datagram to a client now, or after delay ticks */
+struct wheel_entry * fanout_send(struct worker * w, const struct client_registry * r, int dst, uint32_t delay,
+								 const uint8_t * header, void * buffer, size_t len) {
+	struct wheel_entry * e;
 
-/* create a new list and initialize it with its first element */
-struct client_list * list_init (struct sockaddr * addr, socklen_t addrlen) {
-	struct client_list * head;
+	if (delay) {
+		if ( (e = wheel_schedule(w->wheel, delay, &r->addr[dst], r->addrlen[dst], header, buffer, len)) )
+			e->peer = shm_peer_hold(r->shm[dst]);
+		return e;
+	}
 
-	head = (struct client_list *) malloc(sizeof(struct client_list));
+	if (r->shm[dst])
+		shm_peer_send(r->shm[dst], header, buffer, len);
+	else
+		worker_send(w, &r->addr[dst], r->addrlen[dst], header, buffer, len);
+	return NULL;
+}
 
-	if (!head) {
-		perror("malloc()");
+/* relay the frame to a client, after delay ticks. With the collision
+ * engine, the client is told that its channel is busy as the frame starts,
+ * and the frame is delivered at its end unless it collided */
+void fanout_deliver(struct worker * w, const struct client_registry * r, int sender, int dst,
+					uint32_t delay, uint8_t lqi, size_t len) {
+	uint8_t header[ENCAP_HEADER_LEN], * hp = NULL;
+	struct encap_header h;
+	struct wheel_entry * e;
+	struct airtime * frame;
+
+	/* a client that is negotiating the header already delivered its bare
+	 * frames to the other devices of its socket */
+	if (r->version[sender] && !w->header.version &&
+		client_key_same_socket(&r->keys[sender], &r->keys[dst]))
+		return;
+
+	/* a unicast frame only goes to its destination, but the other radios
+	 * still hear it with the collision engine */
+	if (w->unicast >= 0 && dst != w->unicast && !collisions)
+		return;
+
+	/* clients that negotiated the header learn where the frame comes from
+	 * and how well it was received */
+	if (r->version[dst]) {
+		h = w->header;
+		h.version = r->version[dst];
+		h.channel = r->channel[sender];
+		h.lqi = lqi;
+		h.rssi = -100 + lqi * 60 / 255; /* -100 to -40 dBm */
+		h.device = r->keys[dst].device;
+		h.link = r->link[sender];
+		h.flags = promiscuous ? ENCAP_EVERY_FRAME : 0;
+		hp = header;
+	}
+
+	if (!collisions) {
+		if (hp)
+			encap_write(hp, &h);
+		fanout_send(w, r, dst, delay, hp, w->frame, len);
+		return;
+	}
+
+	frame = airtime_start(r->radio[dst], w->start, w->start + delay, w->start + delay + w->airtime,
+							 w->unicast < 0 || dst == w->unicast);
+
+	if (hp) {
+		h.type = ENCAP_BUSY;
+		encap_write(hp, &h);
+		fanout_send(w, r, dst, delay, hp, &w->busy[2], 2);
+		h.type = ENCAP_FRAME;
+		encap_write(hp, &h);
+	} else
+		fanout_send(w, r, dst, delay, NULL, w->busy, ENCAP_CONTROL_OVERHEAD + 2);
+
+	if (w->unicast >= 0 && dst != w->unicast)
+		return;
+
+	if ( (e = wheel_schedule(w->wheel, delay + w->airtime, &r->addr[dst], r->addrlen[dst], hp, w->frame, len)) ) {
+		e->radio = radio_hold(r->radio[dst]);
+		e->frame = frame;
+		e->peer = shm_peer_hold(r->shm[dst]);
+	} else
+		airtime_collided(r->radio[dst], frame); /* the frame is dropped */
+}
+
+/* send a packet to every client on the channel of its sender */
+void fanout(struct worker * w, const struct client_registry * r, int sender, size_t len) {
+	int channel = r->channel[sender], i, dst;
+
+	fanout_begin(w, r, sender, len);
+	if (w->unicast >= 0 && !collisions) {
+		if (w->unicast != sender && r->channel[w->unicast] == channel)
+			fanout_deliver(w, r, sender, w->unicast, 0, 0xff, len);
+	} else
+		for (i = r->channel_first[channel]; i < r->channel_first[channel + 1]; i++) {
+			if ( (dst = r->members[i]) == sender ) /* do not send to self */
+				continue;
+			fanout_deliver(w, r, sender, dst, 0, 0xff, len);
+		}
+	fanout_end(w);
+}
+
+/* send a packet to the neighbours of its sender, according to the
+ * topology. Clients that are not part of the topology are isolated */
+void fanout_topology(struct worker * w, const struct client_registry * r, int sender, size_t len) {
+	const struct link * l, * end;
+	int node = r->node[sender], dst;
+
+	if (node < 0)
+		return;
+
+	fanout_begin(w, r, sender, len);
+	end = &topology->links[topology->first[node + 1]];
+	for (l = &topology->links[topology->first[node]]; l < end; l++) {
+		if ( (dst = r->node_client[l->dst]) < 0 ) /* not registered yet */
+			continue;
+		if (r->channel[dst] != r->channel[sender])
+			continue;
+		if (l->loss && worker_random(w) < l->loss)
+			continue;
+
+		fanout_deliver(w, r, sender, dst, l->delay, l->lqi, len);
+	}
+	fanout_end(w);
+}
+
+/* send a packet to the clients within the range of its sender. Clients
+ * that have no position are isolated */
+void fanout_spatial(struct worker * w, const struct client_registry * r, int sender, size_t len) {
+	int node = r->node[sender], i, n, dst;
+
+	if (node < 0)
+		return;
+
+	pthread_rwlock_rdlock(&spatial->lock);
+	n = spatial_neighbours(spatial, node, w->neighbours);
+	pthread_rwlock_unlock(&spatial->lock);
+
+	fanout_begin(w, r, sender, len);
+	for (i = 0; i < n; i++)
+		if ( (dst = r->node_client[w->neighbours[i]]) >= 0 && /* registered */
+			 r->channel[dst] == r->channel[sender] )
+			fanout_deliver(w, r, sender, dst, 0, 0xff, len);
+	fanout_end(w);
+}
+
+/* virtual clock (-V): the broker is the time master of the clients that
+ * follow it (fakeserial -V), which tell it when their next event (frame to
+ * send or to deliver, end of a transmission) is due. Once no datagram went
+ * through the broker for the idle period, the clients are all waiting for a
+ * deadline (or for their kernel), and the virtual clock jumps to the
+ * earliest deadline instead of waiting for it. The virtual clock is the
+ * monotonic clock plus a skew that only grows, so it still runs while the
+ * kernels, whose timers are not virtual, work. Only used by worker 0 */
+struct vclock {
+	uint64_t idle; /* nanoseconds */
+	uint64_t skew; /* nanoseconds */
+	uint64_t last_activity; /* monotonic clock */
+	int timerfd;
+	int armed;
+	/* next deadline of each client (by index in the registry), on the
+	 * virtual clock, 0 for the clients that never reported one */
+	uint64_t * deadline;
+	int ndeadlines;
+};
+
+static struct vclock * vclock;
+
+void vclock_arm(uint64_t date) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = date / 1000000000;
+	its.it_value.tv_nsec = date % 1000000000;
+	if (timerfd_settime(vclock->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime()");
 		exit(EXIT_FAILURE);
 	}
+	vclock->armed = 1;
+}
 
-	memcpy(&head->addr, addr, sizeof(struct sockaddr));
-	head->addrlen = addrlen;
-	head->next = NULL;
+/* a datagram went through the broker, so the clients are busy */
+void vclock_activity(void) {
+	vclock->last_activity = bench_now();
+	if (!vclock->armed)
+		vclock_arm(vclock->last_activity + vclock->idle);
+}
 
-	return head;
+/* a client reported the time left until its next event */
+void vclock_report(int client, uint64_t left) {
+	int n;
+
+	if (client >= vclock->ndeadlines) {
+		n = client + REGISTRY_INITIAL_SLOTS;
+		vclock->deadline = registry_alloc(vclock->deadline, n * sizeof(*vclock->deadline));
+		memset(&vclock->deadline[vclock->ndeadlines], 0, (n - vclock->ndeadlines) * sizeof(*vclock->deadline));
+		vclock->ndeadlines = n;
+	}
+
+	vclock->deadline[client] = left == UINT64_MAX ? UINT64_MAX : bench_now() + vclock->skew + left;
+}
+
+/* clients left the registry, and the others moved (remap gives the new
+ * index of the n former clients, in their order, -1 for those that left):
+ * move their deadlines along */
+void vclock_remap(const int * remap, int n) {
+	int i, j = 0;
+
+	for (i = 0; i < n && j < vclock->ndeadlines; i++)
+		if (remap[i] >= 0)
+			vclock->deadline[j++] = i < vclock->ndeadlines ? vclock->deadline[i] : 0;
+	for (; j < vclock->ndeadlines; j++)
+		vclock->deadline[j] = 0;
 }
 
-/* find an element in the list or return NULL if none is found */
-struct client_list * list_find(struct client_list * list, struct sockaddr * addr, socklen_t addrlen) {
-	struct client_list * p;
-	for (p = list; p; p = p->next)
-		if (memcmp(p, addr, sizeof(struct sockaddr)) == 0 &&
-			p->addrlen == addrlen)
-			return p;
+/* the idle period may have elapsed: move the virtual clock to the earliest
+ * deadline, and tell the clients */
+void vclock_expire(struct worker * w) {
+	uint8_t header[ENCAP_HEADER_LEN];
+	struct client_registry * r;
+	struct encap_header h;
+	uint64_t expirations, now, target = UINT64_MAX;
+	int i;
+
+	if (read(vclock->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		perror("read()");
+		exit(EXIT_FAILURE);
+	}
+	vclock->armed = 0;
 
-	return NULL;
+	now = bench_now();
+	if (now < vclock->last_activity + vclock->idle) {
+		vclock_arm(vclock->last_activity + vclock->idle);
+		return;
+	}
+
+	for (i = 0; i < vclock->ndeadlines; i++)
+		if (vclock->deadline[i] && vclock->deadline[i] < target)
+			target = vclock->deadline[i];
+	/* the frames the broker delays itself are on the monotonic clock */
+	if (w->wheel && w->wheel->pending && wheel_next(w->wheel) * WHEEL_TICK_NS + vclock->skew < target)
+		target = wheel_next(w->wheel) * WHEEL_TICK_NS + vclock->skew;
+
+	if (target == UINT64_MAX || target <= now + vclock->skew)
+		return;
+
+	PRINTF("virtual clock: skipping %llu us\n", (unsigned long long) (target - now - vclock->skew) / 1000);
+	vclock->skew = target - now;
+	vclock->last_activity = now;
+
+	memset(&h, 0, sizeof(h));
+	h.type = ENCAP_TIME;
+	h.timestamp = vclock->skew;
+
+	registry_enter(w->id);
+	r = registry_get();
+	for (i = 0; i < r->nclients && i < vclock->ndeadlines; i++) {
+		if (!vclock->deadline[i] || !r->version[i])
+			continue;
+		h.version = r->version[i];
+		h.device = r->keys[i].device;
+		encap_write(header, &h);
+		fanout_send(w, r, i, 0, header, w->buffer, 0);
+	}
+	worker_flush(w);
+	registry_leave(w->id);
 }
 
-/* add a new element at the beginning of the list */
-struct client_list * list_add(struct client_list * list, struct sockaddr * addr, socklen_t addrlen) {
-	struct client_list * head;
+/* arm the timer for the next tick the wheel has to process */
+void worker_arm(struct worker * w) {
+	struct itimerspec its;
+	uint64_t next, ns;
 
-	head = (struct client_list *) malloc(sizeof(struct client_list));
+	if (!w->wheel->pending || (next = wheel_next(w->wheel)) == w->armed)
+		return;
 
-	if (!head) {
-		perror("malloc()");
+	memset(&its, 0, sizeof(its));
+	ns = next * WHEEL_TICK_NS;
+	its.it_value.tv_sec = ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	if (timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime()");
 		exit(EXIT_FAILURE);
 	}
+	w->armed = next;
+}
 
-	memcpy(&head->addr, addr, sizeof(struct sockaddr));
-	head->addrlen = addrlen;
-	head->next = list;
+/* send the delayed frames that are due */
+void worker_expire(struct worker * w) {
+	struct wheel_entry * expired, * e, * next;
+	uint64_t expirations;
 
-	return head;
+	if (read(w->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		perror("read()");
+		exit(EXIT_FAILURE);
+	}
+	w->armed = 0;
+	if (vclock)
+		vclock_activity();
+
+	expired = wheel_expire(w->wheel);
+	for (e = expired; e; e = e->next) {
+		if (e->radio && airtime_collided(e->radio, e->frame)) {
+			PRINTF("worker %d: frame lost in a collision\n", w->id);
+			continue;
+		}
+		if (e->peer)
+			shm_peer_send(e->peer, NULL, e->data, e->len);
+		else
+			worker_send(w, &e->addr, e->addrlen, NULL, e->data, e->len);
+	}
+	worker_flush(w);
+
+	for (e = expired; e; e = next) {
+		next = e->next;
+		radio_put(e->radio);
+		shm_peer_put(e->peer);
+		wheel_release(w->wheel, e);
+	}
 }
 
-void print_version() {
-	printf("This software is provided \"AS IS.\"\n"
-		    "NIST MAKES NO WARRANTY OF ANY KIND, EXPRESS, IMPLIED"
-		    "OR STATUTORY, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTY OF"
-		    "MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, NON-INFRINGEMENT"
-		    "AND DATA ACCURACY.  NIST does not warrant or make any representations"
-		    "regarding the use of the software or the results thereof, including but"
-		    "not limited to the correctness, accuracy, reliability or usefulness of"
-		    "this software.\n"
-			"\n"
-			"Written by Tony Cheneau <tony.cheneau@nist.gov>\n");
-    printf("Version 0.1\n");
+/* handle a control datagram (see encap.h) from a client: a channel
+ * announcement ('C', channel and optionally the device, 16 bits) or a HELLO,
+ * the others are dropped. Returns 0 if the datagram is not a control
+ * message */
+int worker_control(struct worker * w, struct client_key * key, const struct sockaddr_storage * addr,
+				   socklen_t addrlen, struct shm_peer * peer, ssize_t len) {
+	uint8_t reply[ENCAP_CONTROL_MAX_LEN], version;
+	const uint8_t * msg = w->buffer + 2;
+	int n;
+
+	if ( (n = encap_control_read(w->buffer, len)) < 0 )
+		return 0;
+
+	if (w->buffer[1] == CHANNEL_NOTIFICATION && (n == 1 || n == 3)) {
+		if (n == 3)
+			key->device = msg[1] << 8 | msg[2];
+		if (msg[0] < NCHANNELS)
+			registry_set_channel(key, addr, addrlen, msg[0]);
+	} else if (w->buffer[1] == ENCAP_HELLO && n == 3 && msg[0]) {
+		version = msg[0] < ENCAP_VERSION ? msg[0] : ENCAP_VERSION;
+		registry_hello(key, addr, addrlen, version, msg[1] << 8 | msg[2], peer);
+		n = encap_control_write(reply, ENCAP_HELLO_REPLY, &version, 1);
+		if (peer)
+			shm_peer_send(peer, NULL, reply, n);
+		else if (sendto(addr->ss_family == AF_UNIX ? unix_sock : w->sock, reply, n, 0,
+						(const struct sockaddr *) addr, addrlen) < 0) {
+			PRINTF("unable to answer a HELLO: %s\n", strerror(errno));
+		}
+	}
 
-	exit(EXIT_SUCCESS);
+	return 1;
 }
 
-void print_usage(const char * prgname) {
-	printf("This program a minimalist UDP broker.\n"
-			"A new client is first detected when it sends a message to the broker.\n"
-			"Subsequently, all messages received by the broker will be send to"
-			"all the clients (except the one sending the message)\n");
+/* relay the datagram held in the worker buffer, received from a socket
+ * (client_addr) or from shared memory (peer) */
+void worker_relay(struct worker * w, struct client_key key, const struct sockaddr_storage * client_addr,
+				  socklen_t client_addr_len, struct shm_peer * peer, ssize_t len) {
+	struct client_registry * r;
+	struct mac_header mac;
+	struct mac_key mk;
+	struct mac_entry * me;
+	uint64_t ts = 0, now;
+	int client;
+	uint8_t version = 0;
+
+	PRINTF("worker %d: received a packet (%lu)\n", w->id, w->packet_seq);
+	++w->packet_seq;
+	if (w->capture)
+		ts = capture_now();
+	if (vclock)
+		vclock_activity();
+
+	if (worker_control(w, &key, client_addr, client_addr_len, peer, len))
+		return;
+
+	registry_enter(w->id);
+	r = registry_get();
+
+	/* clients that negotiated the header send it before every frame (but
+	 * the frames sent during the negotiation) */
+	memset(&w->header, 0, sizeof(w->header));
+	w->frame = w->buffer;
+	if ( (client = registry_find(r, &key)) >= 0 && r->version[client] &&
+		 encap_read(w->buffer, len, &w->header) == 0 ) {
+		if (w->header.type == ENCAP_TIME && vclock) {
+			key.device = w->header.device;
+			if ( (client = registry_find(r, &key)) >= 0 )
+				vclock_report(client, w->header.timestamp);
+			registry_leave(w->id);
+			return;
+		}
+		if (w->header.type != ENCAP_FRAME) {
+			PRINTF("worker %d: unexpected header type, dropping the packet\n", w->id);
+			registry_leave(w->id);
+			return;
+		}
+		version = w->header.version;
+		w->frame += ENCAP_HEADER_LEN;
+		len -= ENCAP_HEADER_LEN;
+		key.device = w->header.device;
+		client = registry_find(r, &key);
+	}
 
-	printf("usage: %s -l portnum [-w pcapfile]\n", prgname);
-	printf("-l, --local-port: local udp port to be bound\n");
-	printf("-w, --write: write all the packet to a pcap file\n");
-	printf("-v, --version: print the program version\n");
-	printf("-h, --help: print this help message\n");
+	/* the devices attached through shared memory are all registered by
+	 * their HELLO */
+	if (client < 0 && peer) {
+		PRINTF("worker %d: frame from an unknown device, dropping it\n", w->id);
+		registry_leave(w->id);
+		return;
+	}
+
+	if (client < 0) {
+		registry_leave(w->id);
+		registry_register(&key, client_addr, client_addr_len, version);
+		registry_enter(w->id);
+		r = registry_get();
+		client = registry_find(r, &key);
+	}
+
+	if (version && w->header.channel != r->channel[client] && w->header.channel < NCHANNELS) {
+		registry_leave(w->id);
+		registry_set_channel(&key, client_addr, client_addr_len, w->header.channel);
+		registry_enter(w->id);
+		r = registry_get();
+	}
+
+	if (w->capture)
+		capture_push(w->capture, ts, r->link[client], w->frame, len);
+
+	/* learn the address of the sender, and find the destination of a
+	 * unicast frame (frames to an unknown address are relayed to every
+	 * client) */
+	w->unicast = -1;
+	if (!promiscuous && mac_parse(w->frame, len, &mac) == 0) {
+		if (mac_learnable(&mac)) {
+			mac_key_init(&mk, mac.src_mode, mac.src_pan, mac.src);
+			me = registry_find_mac_entry(r, &mk);
+			now = bench_now();
+			if (me && me->client - 1 == client)
+				__atomic_store_n(&me->last_seen, now, __ATOMIC_RELAXED);
+			else if (!me || mac_entry_idle(me, now)) {
+				registry_leave(w->id);
+				registry_learn(&mk, client);
+				registry_enter(w->id);
+				r = registry_get();
+			}
+		}
+		if (mac_is_unicast(&mac) && !(mac.dst_mode == MAC_ADDR_SHORT && mac.dst_pan == MAC_BROADCAST)) {
+			mac_key_init(&mk, mac.dst_mode, mac.dst_pan, mac.dst);
+			w->unicast = registry_find_mac(r, &mk);
+		}
+	}
+
+	if (topology)
+		fanout_topology(w, r, client, len);
+	else if (spatial)
+		fanout_spatial(w, r, client, len);
+	else
+		fanout(w, r, client, len);
+	registry_leave(w->id);
 }
 
-int ipv6_server_setup(const char * lport) {
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int sfd, s, yes = 1;
+/* receive a packet on a socket (the worker socket, or the unix socket,
+ * which is non-blocking as every worker waits for it) and relay it */
+void worker_receive(struct worker * w, int sock) {
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_len;
+	struct client_key key;
+	ssize_t len;
+
+	client_addr_len = sizeof(client_addr);
+	len = recvfrom(sock, w->buffer, BUFSIZE, 0, (struct sockaddr *) &client_addr, &client_addr_len);
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		perror("recvfrom()");
+		exit(EXIT_FAILURE);
+	}
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
-    hints.ai_flags = AI_PASSIVE;    /* For wildcard IP address */
-    hints.ai_protocol = 0;          /* Any protocol */
-    hints.ai_canonname = NULL;
-    hints.ai_addr = NULL;
-    hints.ai_next = NULL;
+	/* an unbound unix socket cannot be answered */
+	if (client_addr.ss_family == AF_UNIX && client_addr_len <= offsetof(struct sockaddr_un, sun_path)) {
+		PRINTF("worker %d: packet from an unnamed unix socket, dropping it\n", w->id);
+		return;
+	}
 
-    s = getaddrinfo(NULL, lport, &hints, &result);
-    if (s != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        exit(EXIT_FAILURE);
-    }
+	client_key_init(&key, &client_addr, client_addr_len);
+	worker_relay(w, key, &client_addr, client_addr_len, NULL, len);
+}
 
-    /* getaddrinfo() returns a list of address structures.
-       Try each address until we successfully bind(2).
-       If socket(2) (or bind(2)) fails, we (close the socket
-       and) try the next address. */
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        sfd = socket(rp->ai_family, rp->ai_socktype,
-                rp->ai_protocol);
-        if (sfd == -1)
-            continue;
+/* a shared memory client left (see shm_detach()): stop watching it and
+ * remove its devices from the registry. Only its worker does, so that no
+ * other event of the worker refers to the peer */
+void shm_retire(struct worker * w, struct shm_peer * peer) {
+	int * remap, n;
+
+	if (peer->drops)
+		fprintf(stderr, "a shared memory client left, %llu frames were dropped on a full ring\n",
+				(unsigned long long) peer->drops);
+
+	/* the peer may be freed as soon as the registry no longer refers to it */
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, peer->efd_in, NULL);
+	remap = registry_remove_peer(peer, &n);
+	if (vclock)
+		vclock_remap(remap, n);
+	free(remap);
+}
 
-        if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
-            break;                  /* Success */
+/* relay every datagram waiting in the ring of a shared memory client */
+void worker_receive_shm(struct worker * w, struct shm_peer * peer) {
+	static const struct sockaddr_storage none;
+	uint64_t events;
+	int len;
 
-        close(sfd);
-    }
+	if (read(peer->efd_in, &events, sizeof(events)) < 0 && errno != EAGAIN) {
+		perror("read()");
+		exit(EXIT_FAILURE);
+	}
 
-    if (rp == NULL) {               /* No address succeeded */
-        fprintf(stderr, "Could not bind\n");
-        exit(EXIT_FAILURE);
-    }
+	if (__atomic_load_n(&peer->dead, __ATOMIC_SEQ_CST)) {
+		shm_retire(w, peer);
+		return;
+	}
 
-    freeaddrinfo(result);           /* No longer needed */
+	while ((len = shm_ring_pop(&peer->area->to_broker, w->buffer, sizeof(w->buffer))) >= 0)
+		worker_relay(w, peer->key, &none, 0, peer, len);
+}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes,
-				   sizeof(int)) == -1) {
-		perror("setsockopt()");
+/* add a file descriptor to the event loop of a worker, data identifies it.
+ * Only one of the workers that share a file descriptor is woken up when
+ * exclusive is set */
+void worker_watch(struct worker * w, int fd, void * data, int exclusive) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0);
+	ev.data.ptr = data;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl()");
 		exit(EXIT_FAILURE);
 	}
+}
 
-	return sfd;
+/* receive packets on the worker socket and relay them to the clients */
+void * worker_run(void * arg) {
+	struct worker * w = (struct worker *) arg;
+	struct epoll_event events[WORKER_EVENTS];
+	int i, n;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			fprintf(stderr, "unable to pin worker %d on CPU %d\n", w->id, w->cpu);
+	}
+
+	while (1) {
+		PRINTF("worker %d: waiting for activity\n", w->id);
+
+		/* without a topology, the collision engine, local clients
+		 * (shared memory or unix socket) or a capture, the socket is the only source of packets and nothing
+		 * is ever delayed */
+		if (w->epfd < 0) {
+			worker_receive(w, w->sock);
+			continue;
+		}
+
+		if ( (n = epoll_wait(w->epfd, events, WORKER_EVENTS, -1)) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &w->timerfd)
+				worker_expire(w);
+			else if (vclock && events[i].data.ptr == &vclock->timerfd)
+				vclock_expire(w);
+			else if (events[i].data.ptr == &w->sock)
+				worker_receive(w, w->sock);
+			else if (events[i].data.ptr == &unix_sock)
+				worker_receive(w, unix_sock);
+			else if (events[i].data.ptr == &capture.stop_fd)
+				return NULL; /* SIGINT or SIGTERM, left pending for the others */
+			else
+				worker_receive_shm(w, events[i].data.ptr);
+		}
+		if (w->wheel)
+			worker_arm(w);
+	}
+
+	return NULL;
 }
 
-/* from the pcap.h */
-struct pcap_file_header
-{
-    uint32_t    magic;
-    uint16_t    version_major;
-    uint16_t    version_minor;
-    int32_t     thiszone;
-    uint32_t    sigfigs;
-    uint32_t    snaplen;
-    uint32_t    linktype;
-};
+static struct worker * workers;
 
-struct pcap_pkthdr {
-        uint32_t ts_sec;     /* time stamp (second) */
-        uint32_t ts_msec;    /* time stamp (microseconds) */
-        uint32_t caplen;     /* length of portion present */
-        uint32_t len;        /* length this packet (off wire) */
-};
+/* address of the unix socket the shared memory clients connect to */
+socklen_t shm_socket_address(const char * name, struct sockaddr_un * sun) {
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	/* abstract socket: sun_path starts with a null byte */
+	snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1, "%s%s", SHM_SOCKET_PREFIX, name);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun->sun_path + 1);
+}
 
-/* PCAP related helper function */
+int shm_listen(const char * name) {
+	struct sockaddr_un sun;
+	socklen_t len = shm_socket_address(name, &sun);
+	int fd;
 
-void pcap_write_header(int fd) {
-    struct pcap_file_header header;
+	if ( (fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
 
-    /* see pcap-savefile(5) */
-    header.magic = 0xa1b2c3d4;
-    header.version_major = 2;
-    header.version_minor = 4;
-    header.thiszone = 0;
-    header.sigfigs = 0;
-    header.snaplen = 127; /* max MTU on IEEE 802.15.4 links */
-    header.linktype = 195; /* IEEE 802.15.4 + FCS, see http://www.tcpdump.org/linktypes.html */
+	if (bind(fd, (struct sockaddr *) &sun, len) < 0 || listen(fd, 64) < 0) {
+		perror("unable to listen for shared memory clients");
+		exit(EXIT_FAILURE);
+	}
 
-    if (write(fd, &header, sizeof(header)) < 0) {
-        perror("write");
-        exit(EXIT_FAILURE);
-    }
+	return fd;
 }
 
-void pcap_write_packet(int fd, char * packet, size_t packet_len) {
-    struct pcap_pkthdr header;
-    struct timeval tv;
+/* read the HELLO of a new client along with its memory file and eventfds,
+ * and hand the client over to a worker. Returns NULL if the client is
+ * rejected */
+struct shm_peer * shm_attach(int conn) {
+	static const struct sockaddr_storage none;
+	static uint32_t npeers;
+	uint8_t msg[4], reply[2] = { ENCAP_HELLO_REPLY, 0 };
+	char control[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	struct iovec iov = { msg, sizeof(msg) };
+	struct msghdr mh;
+	struct cmsghdr * cmsg;
+	struct shm_peer * peer;
+	int fds[SHM_NFDS], nfds = 0, i;
+	struct stat st;
+	void * area;
+	ssize_t len;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	len = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), (nfds < SHM_NFDS ? nfds : SHM_NFDS) * sizeof(int));
+	}
+
+	if (len != sizeof(msg) || msg[0] != ENCAP_HELLO || !msg[1] || nfds != SHM_NFDS ||
+		fstat(fds[SHM_FD_AREA], &st) < 0 || st.st_size < (off_t) sizeof(struct shm_area)) {
+		fprintf(stderr, "invalid HELLO from a shared memory client, rejecting it\n");
+		for (i = 0; i < nfds && i < SHM_NFDS; i++)
+			close(fds[i]);
+		return NULL;
+	}
+
+	area = mmap(NULL, sizeof(struct shm_area), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_AREA], 0);
+	close(fds[SHM_FD_AREA]);
+	if (area == MAP_FAILED) {
+		perror("mmap()");
+		close(fds[SHM_FD_TO_BROKER]);
+		close(fds[SHM_FD_TO_CLIENT]);
+		return NULL;
+	}
 
-    memset(&header, 0, sizeof(header));
+	peer = (struct shm_peer *) calloc(1, sizeof(*peer));
+	if (!peer) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	peer->area = (struct shm_area *) area;
+	peer->efd_in = fds[SHM_FD_TO_BROKER];
+	peer->efd_out = fds[SHM_FD_TO_CLIENT];
+	fcntl(peer->efd_in, F_SETFL, O_NONBLOCK);
+	peer->conn = conn;
+	pthread_mutex_init(&peer->lock, NULL);
+	peer->refs = 2; /* the registry and the listener */
+	/* the clients attached through shared memory have no address, they
+	 * are told apart by a number of their own */
+	peer->key.family = AF_UNSPEC;
+	npeers++;
+	memcpy(peer->key.addr, &npeers, sizeof(npeers));
+	peer->worker = npeers % nworkers;
+
+	reply[1] = msg[1] < ENCAP_VERSION ? msg[1] : ENCAP_VERSION;
+	registry_hello(&peer->key, &none, 0, reply[1], msg[2] << 8 | msg[3], peer);
+	if (send(conn, reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+		perror("send()");
+
+	worker_watch(&workers[peer->worker], peer->efd_in, peer, 0);
+	PRINTF("shared memory client %u attached to worker %d\n", npeers, peer->worker);
+
+	return peer;
+}
 
-    gettimeofday(&tv, NULL);
-    /* force casting to 32 bit (struct timeval could be storing in 64 bit format)*/
-    header.ts_sec = (uint32_t) tv.tv_sec;
-    header.ts_msec = (uint32_t) tv.tv_usec;
+/* stop relaying the frames of a client that left, and wake up its worker
+ * to remove it from the registry (see shm_retire()). The peer is freed once
+ * neither the registry nor a delayed frame refers to it */
+void shm_detach(struct shm_peer * peer) {
+	uint64_t one = 1;
+
+	close(peer->conn);
+	__atomic_store_n(&peer->dead, 1, __ATOMIC_SEQ_CST);
+	if (write(peer->efd_in, &one, sizeof(one)) < 0)
+		perror("write()");
+	shm_peer_put(peer);
+}
 
-    header.caplen = packet_len;
-    header.len = packet_len;
+/* accept the shared memory clients, and notice when they leave */
+void * shm_listener(void * arg) {
+	int listener = *(int *) arg, n = 1, capacity = 16, i, conn;
+	struct pollfd * fds = registry_alloc(NULL, capacity * sizeof(*fds));
+	struct shm_peer ** peers = registry_alloc(NULL, capacity * sizeof(*peers));
+	char byte;
 
-    if (write(fd, &header, sizeof(header)) < 0)
-        goto err;
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
 
-    if (write(fd, packet, packet_len) < 0)
-        goto err;
+	while (1) {
+		if (poll(fds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll()");
+			exit(EXIT_FAILURE);
+		}
 
+		/* any activity on a connection means that the client left */
+		for (i = 1; i < n; i++) {
+			if (!fds[i].revents || recv(fds[i].fd, &byte, 1, MSG_DONTWAIT) > 0)
+				continue;
+			shm_detach(peers[i]);
+			n--;
+			fds[i] = fds[n];
+			peers[i] = peers[n];
+			i--; /* the last connection moved here */
+		}
 
-    return;
+		if ((fds[0].revents & POLLIN) && (conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+			if (n == capacity) {
+				capacity *= 2;
+				fds = registry_alloc(fds, capacity * sizeof(*fds));
+				peers = registry_alloc(peers, capacity * sizeof(*peers));
+			}
+			if ( (peers[n] = shm_attach(conn)) ) {
+				fds[n].fd = conn;
+				fds[n].events = POLLIN;
+				n++;
+			} else
+				close(conn);
+		}
+	}
 
-err:
-    perror("write");
-    exit(EXIT_FAILURE);
+	return NULL;
 }
 
 int main(int argc, char *argv[]) {
-	int udpsock;
-    int pcap_fd;
-    unsigned long int packet_seq = 0;
-	int c;
-	fd_set readfds;
-	char * udp_lport = NULL, * pcap_file = NULL;
-	char buffer[BUFSIZE];
-	struct sockaddr client_addr;
-	socklen_t client_addr_len, len = 0;
-	struct client_list *p, * client, * client_list = NULL;
+	int c, i, cpu = -1, shm_fd = -1;
+	char * udp_lport = NULL, * topology_file = NULL, * positions_file = NULL, * unix_path = NULL;
 
 	/* parse the arguments with getopt */
 	while (1) {
 #ifdef HAVE_GETOPT_LONG
 		int opt_idx = -1;
-		c = getopt_long(argc, argv, "w:l:vh", iz_long_opts, &opt_idx);
+		c = getopt_long(argc, argv, "w:C:G:Pl:u:j:a:t:p:b:T:V:cmvh", iz_long_opts, &opt_idx);
 #else
-		c = getopt(argc, argv, "w:l:vh");
+		c = getopt(argc, argv, "w:C:G:Pl:u:j:a:t:p:b:T:V:cmvh");
 #endif
 		if (c == -1)
 			break;
@@ -292,12 +3411,76 @@ int main(int argc, char *argv[]) {
 		case 'l':
 			udp_lport = optarg;
 			break;
+		case 'u':
+			if (!strncmp(optarg, SHM_PREFIX, strlen(SHM_PREFIX)) && optarg[strlen(SHM_PREFIX)])
+				shm_name = optarg + strlen(SHM_PREFIX);
+			else if (!strncmp(optarg, UNIX_PREFIX, strlen(UNIX_PREFIX)) && optarg[strlen(UNIX_PREFIX)])
+				unix_path = optarg + strlen(UNIX_PREFIX);
+			else {
+				fprintf(stderr, "unsupported transport %s (expected shm:/name or unix:/path)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'v':
 			print_version();
 			return 0;
         case 'w':
-            pcap_file = optarg;
+            capture.file = optarg;
+            break;
+        case 'C':
+            capture.max_size = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'G':
+            capture.rotate_seconds = atoi(optarg);
             break;
+        case 'P':
+            capture.pcapng = 1;
+            break;
+		case 'j':
+			nworkers = atoi(optarg);
+			if (nworkers < 1 || nworkers > MAX_WORKERS) {
+				fprintf(stderr, "the number of workers must be between 1 and %d\n", MAX_WORKERS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'a':
+			cpu = atoi(optarg);
+			if (cpu < 0) {
+				fprintf(stderr, "invalid CPU number %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			topology_file = optarg;
+			break;
+		case 'p':
+			positions_file = optarg;
+			break;
+		case 'c':
+			collisions = 1;
+			break;
+		case 'm':
+			promiscuous = 1;
+			break;
+		case 'V':
+			vclock = (struct vclock *) calloc(1, sizeof(*vclock));
+			if (!vclock) {
+				perror("calloc()");
+				exit(EXIT_FAILURE);
+			}
+			vclock->idle = strtoull(optarg, NULL, 10) * 1000;
+			vclock->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (vclock->timerfd < 0) {
+				perror("timerfd_create()");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			spatial_benchmark(atoi(optarg) > 0 ? atoi(optarg) : 10000);
+			return 0;
+		case 'T':
+			transport_benchmark(atoi(optarg) > 0 ? atoi(optarg) : 100000);
+			return 0;
 		case 'h':
 		default:
 			print_usage(argv[0]);
@@ -317,72 +3500,175 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-    if (pcap_file) {
-        PRINTF("opening pcap file %s\n", pcap_file);
-        pcap_fd = open(pcap_file, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IRGRP);
-
-        if (pcap_fd < 0) {
-            perror("open");
-            exit(EXIT_FAILURE);
-        }
-
-        pcap_write_header(pcap_fd);
-    }
+	if ( topology_file && positions_file ) {
+		printf("error: --topology and --positions are mutually exclusive\n");
+		exit(EXIT_FAILURE);
+	}
 
+	/* the deadlines of the clients are only kept by worker 0 */
+	if ( vclock && nworkers > 1 ) {
+		printf("error: --virtual-time requires a single worker\n");
+		exit(EXIT_FAILURE);
+	}
 
+	/* start with an empty registry */
+	registry = (struct client_registry *) calloc(1, sizeof(*registry));
+	workers = (struct worker *) calloc(nworkers, sizeof(*workers));
+	if (!registry || !workers) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
 
-	/* open the broker socket */
-	udpsock = ipv6_server_setup(udp_lport);
+	if (topology_file) {
+		topology = topology_load(topology_file);
+		nodes = &topology->nodes;
+	}
+	if (positions_file) {
+		spatial = spatial_load(positions_file);
+		nodes = &spatial->nodes;
+	}
+	if (nodes) {
+		registry->node_client = registry_alloc(NULL, (nodes->nclients + 1) * sizeof(int));
+		for (i = 0; i < nodes->nclients; i++)
+			registry->node_client[i] = -1;
+	}
 
-	if ( udpsock < 0 ) {
-		perror("ipv6_server_setup()");
-		exit(EXIT_FAILURE);
+	/* the unix socket is shared by the workers */
+	if (unix_path)
+		unix_sock = unix_server_setup(unix_path);
+
+	/* with a capture, the workers stop on SIGINT or SIGTERM, which are
+	 * blocked in every thread */
+	if (capture.file) {
+		sigemptyset(&capture.signals);
+		sigaddset(&capture.signals, SIGINT);
+		sigaddset(&capture.signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &capture.signals, NULL);
+		if ( (capture.stop_fd = signalfd(-1, &capture.signals, SFD_CLOEXEC)) < 0 ) {
+			perror("signalfd()");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	/* start the processing loop */
-	while (1) {
-		FD_ZERO(&readfds);
-		FD_SET(udpsock, &readfds);
+	/* open the broker sockets, one per worker */
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i;
+		workers[i].cpu = cpu >= 0 ? (cpu + i) % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+		workers[i].sock = ipv6_server_setup(udp_lport, nworkers > 1);
 
-		PRINTF("select: waiting for activity\n");
-		if ( 0 >= select(udpsock + 1, &readfds, NULL, NULL, NULL)) {
-			perror("select()");
+		if ( workers[i].sock < 0 ) {
+			perror("ipv6_server_setup()");
 			exit(EXIT_FAILURE);
 		}
 
-		if (FD_ISSET(udpsock, &readfds)) {
-			PRINTF("select: received a packet (%lu)\n", packet_seq);
-            ++packet_seq;
-			len = recvfrom(udpsock, buffer, BUFSIZE, 0, &client_addr, &client_addr_len);
-			if (len < 0) {
-				perror("recvfrom()");
+		if (spatial)
+			workers[i].neighbours = registry_alloc(NULL, (nodes->nclients + 1) * sizeof(int));
+
+		/* delayed frames are kept in a timer wheel, per worker */
+		workers[i].timerfd = -1;
+		if (topology || collisions) {
+			workers[i].wheel = (struct timer_wheel *) malloc(sizeof(struct timer_wheel));
+			if (!workers[i].wheel) {
+				perror("malloc()");
+				exit(EXIT_FAILURE);
+			}
+			wheel_init(workers[i].wheel);
+			workers[i].rng = ((uint64_t) time(NULL) << 8) ^ (i + 1) * 0x9E3779B97F4A7C15ull;
+			workers[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (workers[i].timerfd < 0) {
+				perror("timerfd_create()");
 				exit(EXIT_FAILURE);
 			}
+		}
 
-            if (pcap_file)
-                pcap_write_packet(pcap_fd, buffer, len);
+		/* the worker waits for several sources with epoll */
+		workers[i].epfd = -1;
+		if (workers[i].wheel || shm_name || unix_path || vclock || capture.file) {
+			if ( (workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+				perror("epoll_create1()");
+				exit(EXIT_FAILURE);
+			}
+			worker_watch(&workers[i], workers[i].sock, &workers[i].sock, 0);
+			if (workers[i].wheel)
+				worker_watch(&workers[i], workers[i].timerfd, &workers[i].timerfd, 0);
+			if (unix_path)
+				worker_watch(&workers[i], unix_sock, &unix_sock, 1);
+			if (vclock)
+				worker_watch(&workers[i], vclock->timerfd, &vclock->timerfd, 0);
+			if (capture.file)
+				worker_watch(&workers[i], capture.stop_fd, &capture.stop_fd, 0);
+		}
+	}
 
+	/* positions are reloaded on SIGHUP by a thread of their own. The
+	 * signals handled by a dedicated thread are blocked before any thread
+	 * is started */
+	if (spatial) {
+		sigset_t set;
 
-			if ( (client = list_find(client_list, &client_addr, client_addr_len)) == NULL )
-			{
-				PRINTF("received a message from a new client, registering the client\n");
-				if (client_list)
-					client_list = list_add(client_list, &client_addr, client_addr_len);
-				else
-					client_list = list_init(&client_addr, client_addr_len);
+		sigemptyset(&set);
+		sigaddset(&set, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
 
-				client = list_find(client_list, &client_addr, client_addr_len);
+	/* the capture rings are drained by a writer thread. The termination
+	 * signals stop the workers, and then the writer */
+	if (capture.file) {
+		capture.rings = (struct capture_ring **) calloc(nworkers, sizeof(*capture.rings));
+		if (!capture.rings) {
+			perror("calloc()");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < nworkers; i++) {
+			if (posix_memalign((void **) &workers[i].capture, 64, sizeof(struct capture_ring)) != 0) {
+				perror("posix_memalign()");
+				exit(EXIT_FAILURE);
 			}
+			memset(workers[i].capture, 0, sizeof(struct capture_ring));
+			capture.rings[i] = workers[i].capture;
+		}
+		capture.nrings = nworkers;
 
-			for (p=client_list; p; p=p->next) {
-				if (p == client) /* do not send to self */
-					continue;
-				sendto(udpsock, buffer, len, 0, &p->addr, p->addrlen);
-			}
+		capture_start();
+	}
+
+	if (spatial) {
+		pthread_t reloader;
+
+		if ( (errno = pthread_create(&reloader, NULL, spatial_reloader, NULL)) != 0 ) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (shm_name) {
+		pthread_t listener;
+
+		shm_fd = shm_listen(shm_name);
+		if ( (errno = pthread_create(&listener, NULL, shm_listener, &shm_fd)) != 0 ) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
 		}
 	}
 
-	close(udpsock);
-    close(pcap_fd);
+	/* start the processing loops, the main thread is worker 0 */
+	for (i = 1; i < nworkers; i++)
+		if ( (errno = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) != 0 ) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+
+	worker_run(&workers[0]);
+
+	/* the workers only return to flush the capture */
+	for (i = 1; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (capture.file)
+		capture_stop();
+
+	for (i = 0; i < nworkers; i++)
+		close(workers[i].sock);
+	if (unix_path)
+		unlink(unix_path);
 	return 0;
 }